@@ -279,15 +279,37 @@ T deserialize(const __serialize_detail::stream& res) {
 
 // Serializer for StackIndex::Index
 namespace __serialize_detail {
+  template <>
+  struct serialize_helper<Components> {
+      static void apply(const Components& obj, stream_ptr& res) {
+          serializer(obj.comp, res);
+          serializer(obj.link, res);
+          serializer(obj.head, res);
+          serializer(obj.vol, res);
+      }
+  };
+
+  template <>
+  struct deserialize_helper<Components> {
+      static Components apply(stream_cptr& begin, stream_cptr end) {
+          Components obj;
+          obj.comp = deserialize_helper<std::vector<node_id>>::apply(begin, end);
+          obj.link = deserialize_helper<std::vector<node_id>>::apply(begin, end);
+          obj.head = deserialize_helper<std::vector<node_id>>::apply(begin, end);
+          obj.vol = deserialize_helper<std::vector<uint64_t>>::apply(begin, end);
+          return obj;
+      }
+  };
+
   template <>
   struct serialize_helper<StackIndex::Stack> {
       static void apply(const StackIndex::Stack& obj, stream_ptr& res) {
           printf("serialize_helper<StackIndex::Stack>\n");
           print(1);
-          // print(obj.column);
           serializer(obj.top, res);
           print(2);
-          serializer(obj.column, res);
+          serializer((uint32_t)obj.width(), res);
+          serializer(std::vector<uint8_t>(obj.data(), obj.data() + obj.top * obj.width()), res);
           printf("serialize_helper<StackIndex::Stack> end\n");
       }
   };
@@ -298,10 +320,7 @@ namespace __serialize_detail {
           printf("serialize_helper<StackIndex::StackTree>\n");
           serializer(obj._stacktree, res);
           serializer(obj.next, res);
-          serializer(obj.root, res);
-          serializer(obj.vol, res);
-          serializer(obj.aux_traverse, res);
-          serializer(obj.aux_last, res);
+          serializer(obj.components, res);
       }
   };
 
@@ -317,8 +336,10 @@ namespace __serialize_detail {
   struct deserialize_helper<StackIndex::Stack> {
       static StackIndex::Stack apply(stream_cptr& begin, stream_cptr end) {
           StackIndex::Stack obj;
-          obj.top = deserialize_helper<size_t>::apply(begin, end);
-          obj.column = deserialize_helper<std::vector<node_id>>::apply(begin, end);
+          uint32_t top = deserialize_helper<uint32_t>::apply(begin, end);
+          uint32_t width = deserialize_helper<uint32_t>::apply(begin, end);
+          std::vector<uint8_t> raw = deserialize_helper<std::vector<uint8_t>>::apply(begin, end);
+          obj.assign(top, width, raw.data());
           return obj;
       }
   };
@@ -329,10 +350,7 @@ namespace __serialize_detail {
           StackIndex::StackTree obj;
           obj._stacktree = deserialize_helper<std::vector<StackIndex::Stack>>::apply(begin, end);
           obj.next = deserialize_helper<std::vector<node_id>>::apply(begin, end);
-          obj.root = deserialize_helper<std::vector<node_id>>::apply(begin, end);
-          obj.vol = deserialize_helper<std::vector<double>>::apply(begin, end);
-          obj.aux_traverse = deserialize_helper<std::vector<node_id>>::apply(begin, end);
-          obj.aux_last = deserialize_helper<std::vector<node_id>>::apply(begin, end);
+          obj.components = deserialize_helper<Components>::apply(begin, end);
           return obj;
       }
   };
@@ -9,7 +9,8 @@
 #include <functional>
 #include <iomanip>
 #include <filesystem>
-#include <algorithm>
+#include <algorithm>
+#include <cstring>
 
 
 
@@ -358,3 +359,17 @@ std::vector<double> generateGeometricSequence(double a, double b, int num) {
 }
 
 
+
+// resident set size of this process from /proc/self/status: field is
+// "VmRSS" for the current value and "VmHWM" for the peak; 0 if unavailable
+size_t rss_bytes(const char *field = "VmRSS"){
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    size_t len = strlen(field);
+    while (std::getline(status, line)) {
+        if (line.compare(0, len, field) == 0 && line[len] == ':') {
+            return std::stoull(line.substr(len + 1)) * 1024;
+        }
+    }
+    return 0;
+}
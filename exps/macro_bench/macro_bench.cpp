@@ -0,0 +1,328 @@
+#include "Index-stackindex.hpp"
+#include "Index-rw.hpp"
+#include "Index-realtime.hpp"
+#include "windex_inc.hpp"
+#include "apps/types.hpp"
+#include "fora_skeleton.hpp"
+#include "graph.hpp"
+#include "graph_types.hpp"
+#include "io/file.hpp"
+#include "lib/random.hpp"
+#include "log/log.h"
+#include "time/timer.hpp"
+#include "exp_util.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <poll.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// Side-by-side comparison of the index methods on one dataset and workload.
+// Every (graph size, method, thread count) runs in a child process of its
+// own, with the RNG seeded alike: it builds the index, replays the
+// workload, and reports one row of build time, memory, query and update
+// latency percentiles and the l1 error of the first queries against exact
+// PPR. A child past --timeout is killed and its row says so, as does the
+// row of one that crashed, so one method cannot stall or end the sweep.
+// Smaller graphs are the subgraphs induced by the first nodes, with the
+// workload operations outside them dropped. Only stackindex uses more than
+// one thread, so the other methods run once per size.
+
+using bench_clock = std::chrono::steady_clock;
+
+// what a child reports back through its pipe
+struct Row {
+    size_t n = 0, m = 0;
+    double build_time = 0;
+    size_t index_bytes = 0, peak_rss = 0;
+    size_t queries = 0, updates = 0;
+    double query[5] = {}, update[5] = {}; // mean, p50, p90, p99, max
+    size_t err_queries = 0;
+    double l1_err = 0;
+};
+
+// mean, p50, p90, p99 and max of xs, at the rank q * (size - 1)
+void summarize(std::vector<double> xs, double out[5]) {
+    if (xs.empty()) return;
+    std::sort(xs.begin(), xs.end());
+    double sum = 0;
+    for (double x : xs) sum += x;
+    out[0] = sum / xs.size();
+    const double qs[] = {0.50, 0.90, 0.99};
+    for (int i = 0; i < 3; i++) out[i + 1] = xs[(size_t)(qs[i] * (xs.size() - 1))];
+    out[4] = xs.back();
+}
+
+// PPR from s on G, pushing every residue each round until at most tol is
+// left; a walk that reaches a dangling node stops there, as in FORA
+std::vector<double> exact_ppr(graph *G, node_id s, double alpha, double tol = 1e-10) {
+    size_t n = G->num_nodes();
+    std::vector<double> reserve(n), residue(n), next(n);
+    residue[s] = 1;
+    for (double left = 1; left > tol;) {
+        std::fill(next.begin(), next.end(), 0);
+        for (node_id u = 0; u < n; u++) {
+            if (residue[u] == 0) continue;
+            if (G->is_dangling_node(u)) {
+                reserve[u] += residue[u];
+                continue;
+            }
+            reserve[u] += alpha * residue[u];
+            double share = (1 - alpha) * residue[u] / G->get_degree(u);
+            for (node_id v : G->get_neighbourhood(u)) next[v] += share;
+        }
+        residue.swap(next);
+        left = 0;
+        for (double r : residue) left += r;
+    }
+    return reserve;
+}
+
+IndexMethod<Config> *make_index(const std::string &method, graph *G, Config &C) {
+    if (method == "stackindex") return new StackIndex(G, &C);
+    if (method == "rwindex") return new RwIndex(G, &C);
+    if (method == "realtime") return new RealTimeIndex(G, &C);
+    if (method == "windex_inc") return new windex_inc(G, C.is_dird, C);
+    return nullptr;
+}
+
+// build the index of method on the first n nodes and replay the workload
+Row run(const std::string &method, size_t threads, node_id n, bool directed, const edge_list &edges,
+        const std::vector<update> &w, uint32_t seed, size_t truth_queries) {
+    Row r;
+    Config C(true, 0.2, 0.3, 0.1, 0.01, 0.01);
+    C.is_dird = directed;
+    C.num_threads = threads;
+
+    graph *G = new graph(n);
+    for (auto [u, v] : edges) {
+        if (u >= n || v >= n) continue;
+        G->insert_edge(u, v);
+        if (!directed && u != v)
+            G->insert_edge(v, u);
+    }
+    r.n = n;
+    r.m = G->num_edges();
+
+    rand_uint.seed(seed);
+    auto start = bench_clock::now();
+    IndexMethod<Config> *I = make_index(method, G, C);
+    r.build_time = std::chrono::duration<double>(bench_clock::now() - start).count();
+    r.index_bytes = I->memory_usage().total();
+
+    FORA<Config> *f = new FORA<Config>;
+    std::vector<double> res;
+    auto outputer = [&](const std::vector<double> &ppr) {
+        res = std::move(ppr);
+    };
+
+    // the workload draws from the same stream whatever the build used
+    rand_uint.seed(seed);
+    std::vector<double> qs, us;
+    for (auto [o, u, v] : w) {
+        if (u >= n || (o != '?' && v >= n)) continue;
+        Timer::reset_all();
+        if (o == '?') {
+            f->evaluate_noprint(I, u, outputer);
+            qs.push_back(Timer::used(TIMER::EVALUATE));
+            // untimed, against the graph as the query saw it
+            if (r.err_queries < truth_queries) {
+                r.l1_err += l1_err(exact_ppr(G, u, C.alpha), res);
+                r.err_queries++;
+            }
+        } else if (o == '+') {
+            f->insert_edge(u, v, I);
+            us.push_back(Timer::used(TIMER::UPDATE));
+        } else if (o == '-') {
+            f->delete_edge(u, v, I);
+            us.push_back(Timer::used(TIMER::UPDATE));
+        }
+    }
+    r.queries = qs.size();
+    r.updates = us.size();
+    summarize(qs, r.query);
+    summarize(us, r.update);
+    if (r.err_queries) r.l1_err /= r.err_queries;
+    r.peak_rss = rss_bytes("VmHWM");
+
+    delete f;
+    delete I;
+    delete G;
+    return r;
+}
+
+// run body in a child and return its row; status is "ok", "timeout" or
+// "crashed" (no complete row, e.g. killed by a signal or an assertion)
+Row isolated(std::function<Row()> body, double timeout, std::string &status) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        status = "crashed";
+        return {};
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        Row r = body();
+        bool ok = write(fds[1], &r, sizeof(r)) == sizeof(r);
+        _exit(ok ? 0 : 1);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        status = "crashed";
+        return {};
+    }
+
+    Row r;
+    size_t got = 0;
+    auto deadline = bench_clock::now() + std::chrono::duration<double>(timeout);
+    bool timed_out = false;
+    while (got < sizeof(r)) {
+        double left = std::chrono::duration<double>(deadline - bench_clock::now()).count();
+        if (left <= 0) {
+            timed_out = true;
+            break;
+        }
+        pollfd p{fds[0], POLLIN, 0};
+        if (poll(&p, 1, (int)std::min(left * 1000 + 1, 1e9)) <= 0) continue;
+        ssize_t k = read(fds[0], (char *)&r + got, sizeof(r) - got);
+        if (k <= 0) break;
+        got += k;
+    }
+    close(fds[0]);
+    if (timed_out) kill(pid, SIGKILL);
+    int wstatus = 0;
+    waitpid(pid, &wstatus, 0);
+    if (timed_out) status = "timeout";
+    else if (got < sizeof(r) || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) status = "crashed";
+    else status = "ok";
+    if (status != "ok") r = Row{};
+    return r;
+}
+
+std::string number(double x) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.9g", x);
+    return buf;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <dataset> <workload> <savedir> [--methods <m1,m2,...>] [--threads <t1,t2,...>] [--sizes <f1,f2,...>] [--seed <s>] [--truth-queries <k>] [--timeout <s>]\n", argv[0]);
+        return 1;
+    }
+
+    // --methods: among stackindex, rwindex, realtime and windex_inc (all by
+    // default); rwindex is static and keeps its walks through updates
+    // --threads: thread counts stackindex is run with
+    // --sizes: fractions of the nodes to induce the graphs from
+    // --seed: RNG seed of every build and workload replay
+    // --truth-queries: queries per run checked against exact PPR
+    // --timeout: seconds a run may take before it is killed
+    std::vector<std::string> methods = {"stackindex", "rwindex", "realtime", "windex_inc"};
+    std::vector<size_t> threads = {1};
+    std::vector<double> sizes = {1};
+    uint32_t seed = 1;
+    size_t truth_queries = 20;
+    double timeout = 3600;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--methods") == 0 && i + 1 < argc) methods = split(argv[++i], ",");
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads.clear();
+            for (auto &t : split(argv[++i], ",")) threads.push_back(std::max(1, atoi(t.c_str())));
+        }
+        else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            sizes.clear();
+            for (auto &s : split(argv[++i], ",")) sizes.push_back(std::min(1.0, atof(s.c_str())));
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--truth-queries") == 0 && i + 1 < argc) truth_queries = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) timeout = atof(argv[++i]);
+    }
+    for (auto &method : methods) {
+        if (method != "stackindex" && method != "rwindex" && method != "realtime" && method != "windex_inc") {
+            fprintf(stderr, "Unknown method: %s\n", method.c_str());
+            return 1;
+        }
+    }
+
+    std::string dataset(argv[1]);
+    std::string workload(argv[2]);
+    std::string savedir(argv[3]);
+    ensure_dir(savedir);
+
+    fprintf(stdout, "loading meta data\n");
+    auto [n, m, directed] = load_file<graph_meta>(file_path(2, argv[1], "meta"));
+    fprintf(stdout, "n = %zu, m = %zu, %s\n", (size_t)n, (size_t)m,
+            directed ? "directed" : "undirected");
+    fflush(stdout);
+    auto edges = load_file<edge_list>(file_path(2, argv[1], "graph_base"));
+    std::vector<update> w = load_file<std::vector<update>>(file_path(3, argv[1], "workloads", argv[2]));
+
+    std::string csvpath = savedir + "/macro_bench.csv";
+    std::ofstream csv(csvpath);
+    csv << "dataset,workload,fraction,n,m,method,threads,status,build_time,index_bytes,peak_rss,"
+           "queries,query_mean,query_p50,query_p90,query_p99,query_max,"
+           "updates,update_mean,update_p50,update_p90,update_p99,update_max,err_queries,l1_err" << std::endl;
+    std::string json = "{\"dataset\": \"" + dataset + "\", \"workload\": \"" + workload +
+                       "\", \"seed\": " + std::to_string(seed) + ", \"runs\": [";
+    size_t runs = 0;
+
+    printf("%-6s %-12s %3s %-8s %12s %12s %12s %12s %12s %12s\n", "size", "method", "t", "status",
+           "build(s)", "bytes", "query p50", "query p99", "update p99", "l1 err");
+    for (double fraction : sizes) {
+        node_id sub = std::max<node_id>(1, (node_id)std::ceil(fraction * n));
+        for (auto &method : methods) {
+            for (size_t t : threads) {
+                if (method != "stackindex" && t != threads.front()) continue;
+                size_t used = method == "stackindex" ? t : 1;
+                std::string status;
+                Row r = isolated([&]() { return run(method, used, sub, directed, edges, w, seed, truth_queries); },
+                                 timeout, status);
+
+                printf("%-6s %-12s %3zu %-8s %12.6f %12zu %12.3e %12.3e %12.3e %12.3e\n", number(fraction).c_str(),
+                       method.c_str(), used, status.c_str(), r.build_time, r.index_bytes, r.query[1], r.query[3],
+                       r.update[3], r.l1_err);
+                fflush(stdout);
+
+                csv << dataset << "," << workload << "," << number(fraction) << "," << sub << "," << r.m << ","
+                    << method << "," << used << "," << status << "," << number(r.build_time) << ","
+                    << r.index_bytes << "," << r.peak_rss << "," << r.queries;
+                for (double x : r.query) csv << "," << number(x);
+                csv << "," << r.updates;
+                for (double x : r.update) csv << "," << number(x);
+                csv << "," << r.err_queries << "," << number(r.l1_err) << std::endl;
+
+                static const char *stats[] = {"mean", "p50", "p90", "p99", "max"};
+                std::string query = "{\"count\": " + std::to_string(r.queries);
+                std::string update = "{\"count\": " + std::to_string(r.updates);
+                for (int i = 0; i < 5; i++) {
+                    query += std::string(", \"") + stats[i] + "\": " + number(r.query[i]);
+                    update += std::string(", \"") + stats[i] + "\": " + number(r.update[i]);
+                }
+                json += std::string(runs++ ? ",\n  " : "\n  ") + "{\"fraction\": " + number(fraction) +
+                        ", \"n\": " + std::to_string(sub) + ", \"m\": " + std::to_string(r.m) +
+                        ", \"method\": \"" + method + "\", \"threads\": " + std::to_string(used) +
+                        ", \"status\": \"" + status + "\", \"build_time\": " + number(r.build_time) +
+                        ", \"index_bytes\": " + std::to_string(r.index_bytes) +
+                        ", \"peak_rss\": " + std::to_string(r.peak_rss) +
+                        ", \"query_latency\": " + query + "}, \"update_latency\": " + update +
+                        "}, \"err_queries\": " + std::to_string(r.err_queries) + ", \"l1_err\": " + number(r.l1_err) + "}";
+            }
+        }
+    }
+    std::string jsonpath = savedir + "/macro_bench.json";
+    std::ofstream(jsonpath) << json << "\n]}" << std::endl;
+    printf("Saved to %s and %s\n", csvpath.c_str(), jsonpath.c_str());
+    return 0;
+}
@@ -0,0 +1,342 @@
+#include "Index-stackindex.hpp"
+#include "Index-realtime.hpp"
+#include "apps/types.hpp"
+#include "fora_skeleton.hpp"
+#include "graph.hpp"
+#include "graph_types.hpp"
+#include "io/file.hpp"
+#include "lib/random.hpp"
+#include "lib/scarray.hpp"
+#include "log/log.h"
+#include "simple_walk.hpp"
+#include "time/timer.hpp"
+#include "exp_util.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Microbenchmarks of the core kernels, away from the I/O and printing of
+// the experiment drivers. Each kernel runs count operations per repetition,
+// with count doubled until a repetition lasts --min-time seconds; after
+// that calibration (which also warms up) it is repeated --reps times and
+// the nanoseconds per operation of every repetition are summarized. Setup
+// work between operations (resetting vectors, picking edges) is left out
+// of the timed part where it would dominate.
+
+using bench_clock = std::chrono::steady_clock;
+
+// keep x from being optimized away
+template <typename T>
+void keep(const T &x) {
+    asm volatile("" : : "g"(&x) : "memory");
+}
+
+struct Result {
+    std::string name, param;
+    size_t ops = 0; // per repetition
+    std::vector<double> ns; // per operation, one per repetition
+};
+
+struct Bench {
+    size_t reps = 10;
+    double min_time = 0.02;
+    uint32_t seed = 1;
+    std::string filter;
+    std::vector<Result> results;
+
+    // run(count) performs count operations and returns the seconds they took
+    void measure(const std::string &name, const std::string &param, std::function<double(size_t)> run) {
+        if (!filter.empty() && (name + "/" + param).find(filter) == std::string::npos) return;
+        rand_uint.seed(seed);
+        size_t count = 1;
+        while (run(count) < min_time && count < (1u << 26)) count *= 2;
+
+        Result r{name, param, count, {}};
+        for (size_t i = 0; i < reps; i++) r.ns.push_back(run(count) * 1e9 / count);
+        std::vector<double> ns = r.ns;
+        std::sort(ns.begin(), ns.end());
+        printf("%-24s %-16s %10zu ops  min %12.1f  median %12.1f ns/op\n",
+               name.c_str(), param.c_str(), count, ns.front(), ns[ns.size() / 2]);
+        fflush(stdout);
+        results.push_back(std::move(r));
+    }
+
+    // op(i) timed as a whole loop
+    void loop(const std::string &name, const std::string &param, std::function<void(size_t)> op) {
+        measure(name, param, [&](size_t count) {
+            auto start = bench_clock::now();
+            for (size_t i = 0; i < count; i++) op(i);
+            return std::chrono::duration<double>(bench_clock::now() - start).count();
+        });
+    }
+
+    // op(i) timed on its own, after an untimed prepare(i)
+    void each(const std::string &name, const std::string &param,
+              std::function<void(size_t)> prepare, std::function<void(size_t)> op) {
+        measure(name, param, [&](size_t count) {
+            double t = 0;
+            for (size_t i = 0; i < count; i++) {
+                prepare(i);
+                auto start = bench_clock::now();
+                op(i);
+                t += std::chrono::duration<double>(bench_clock::now() - start).count();
+            }
+            return t;
+        });
+    }
+
+    // {"graph": {..}, "reps": .., "min_time": .., "seed": .., "benchmarks":
+    //  [{"name": .., "param": .., "ops": .., "ns_per_op": {"min": .., "median": ..,
+    //    "mean": .., "stddev": .., "max": ..}, "samples": [..]}, ..]}
+    std::string json(const std::string &graph) const {
+        std::string s = "{\"graph\": " + graph + ", \"reps\": " + std::to_string(reps) +
+                        ", \"min_time\": " + number(min_time) + ", \"seed\": " + std::to_string(seed) + ", \"benchmarks\": [";
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result &r = results[i];
+            std::vector<double> ns = r.ns;
+            std::sort(ns.begin(), ns.end());
+            double mean = 0, var = 0;
+            for (double x : ns) mean += x / ns.size();
+            for (double x : ns) var += (x - mean) * (x - mean) / std::max<size_t>(1, ns.size() - 1);
+            s += std::string(i ? ",\n  " : "\n  ") + "{\"name\": \"" + r.name + "\", \"param\": \"" + r.param +
+                 "\", \"ops\": " + std::to_string(r.ops) +
+                 ", \"ns_per_op\": {\"min\": " + number(ns.front()) + ", \"median\": " + number(ns[ns.size() / 2]) +
+                 ", \"mean\": " + number(mean) + ", \"stddev\": " + number(std::sqrt(var)) +
+                 ", \"max\": " + number(ns.back()) + "}, \"samples\": [";
+            for (size_t k = 0; k < r.ns.size(); k++) s += (k ? ", " : "") + number(r.ns[k]);
+            s += "]}";
+        }
+        return s + "\n]}";
+    }
+
+    static std::string number(double x) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.6g", x);
+        return buf;
+    }
+};
+
+struct Walker : simple_walk {
+    using simple_walk::random_walk;
+};
+
+graph *read_graph(const char *dataset, Config & C) {
+    fprintf(stdout, "loading meta data\n");
+    auto [n, m, directed] = load_file<graph_meta>(file_path(2, dataset, "meta"));
+    fprintf(stdout, "n = %zu, m = %zu, %s\n", (size_t)n, (size_t)m,
+            directed ? "directed" : "undirected");
+    fflush(stdout);
+
+    auto edges = load_file<edge_list>(file_path(2, dataset, "graph"));
+    graph *g = new graph(n);
+    for (auto [u, v] : edges) {
+        g->insert_edge(u, v);
+        if (!directed && u != v)
+            g->insert_edge(v, u);
+    }
+
+    C.is_dird = directed;
+    return g;
+}
+
+// G(n, p) with the geometric skips of randgraph's generate, on nodes 0..n-1
+graph *random_graph(node_id n, double p, bool directed, Config & C) {
+    fprintf(stdout, "generating G(%zu, %g), %s\n", (size_t)n, p, directed ? "directed" : "undirected");
+    graph *g = new graph(n);
+    for (node_id u = 0; u < n && p > 0; u++) {
+        for (uint64_t v = directed ? 0 : u; ; ) {
+            v += rand_geometric(p);
+            if (v > n) break;
+            if (v - 1 == u) continue;
+            g->insert_edge(u, v - 1);
+            if (!directed) g->insert_edge(v - 1, u);
+        }
+    }
+    fprintf(stdout, "n = %zu, m = %zu\n", (size_t)n, (size_t)g->num_edges());
+    C.is_dird = directed;
+    return g;
+}
+
+// a uniformly random edge, by a random node with neighbours
+std::pair<node_id, node_id> random_edge(graph *G) {
+    while (true) {
+        node_id u = rand_uniform(G->num_nodes());
+        if (G->is_dangling_node(u)) continue;
+        return {u, G->get_neighbour(u, rand_uniform(G->get_degree(u)))};
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <dataset>|gnp:<n>:<p>[:undirected] <savedir> [--reps <r>] [--min-time <s>] [--seed <s>] [--filter <substring>]\n", argv[0]);
+        return 1;
+    }
+
+    // --reps: repetitions summarized per kernel
+    // --min-time: seconds a repetition lasts at least
+    // --seed: RNG seed, reset before every kernel and for the synthetic graph
+    // --filter: run only the kernels whose name/param contains it
+    Bench B;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) B.reps = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) B.min_time = atof(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) B.seed = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) B.filter = argv[++i];
+    }
+
+    std::string dataset(argv[1]);
+    std::string savedir(argv[2]);
+    ensure_dir(savedir);
+
+    Config C(true, 0.2, 0.3, 0.1, 0.01, 0.01); // precision (0.3,0.1,0.01,0.01 fixed to make omega 12)
+    graph *G;
+    std::string name;
+    rand_uint.seed(B.seed);
+    if (dataset.rfind("gnp:", 0) == 0) {
+        auto parts = split(dataset, ":");
+        if (parts.size() < 3) {
+            fprintf(stderr, "expected gnp:<n>:<p>[:undirected], got %s\n", dataset.c_str());
+            return 1;
+        }
+        bool directed = parts.size() < 4 || parts[3] != "undirected";
+        G = random_graph(std::stoul(parts[1]), std::stod(parts[2]), directed, C);
+        name = "gnp_" + parts[1] + "_" + parts[2] + (directed ? "" : "_undirected");
+    } else {
+        G = read_graph(dataset.c_str(), C);
+        name = dataset.substr(dataset.find_last_of('/') + 1);
+    }
+    node_id n = G->num_nodes();
+    std::string graph_json = "{\"name\": \"" + name + "\", \"n\": " + std::to_string(n) +
+                             ", \"m\": " + std::to_string(G->num_edges()) +
+                             ", \"directed\": " + (C.is_dird ? "true" : "false") + "}";
+
+    // samplers of lib/random.hpp
+    uint64_t sink = 0;
+    B.loop("rand_uniformf", "", [&](size_t) { sink += rand_uniformf() < 0.5; });
+    B.loop("rand_uniform", "n=1000", [&](size_t) { sink += rand_uniform(1000); });
+    for (double p : {0.5, 0.01})
+        B.loop("rand_geometric", "p=" + Bench::number(p), [&](size_t) { sink += rand_geometric(p); });
+    B.loop("rand_binomial", "n=100,p=0.1", [&](size_t) { sink += rand_binomial(100, 0.1); });
+    B.loop("rand_keyed", "", [&](size_t i) { sink += rand_keyed(B.seed, i); });
+    B.loop("rand_keyed_uniform", "n=1000", [&](size_t i) { sink += rand_keyed_uniform(B.seed, i, 1000); });
+    B.loop("rand_keyed_geometric", "p=0.2", [&](size_t i) { sink += rand_keyed_geometric(B.seed, i, 0.2); });
+    keep(sink);
+
+    // scarray growth and removal, per element
+    B.measure("scarray_emplace", "", [&](size_t count) {
+        auto start = bench_clock::now();
+        scarray<node_id> a;
+        for (size_t i = 0; i < count; i++) a.emplace((node_id)i);
+        keep(a);
+        return std::chrono::duration<double>(bench_clock::now() - start).count();
+    });
+    B.measure("scarray_remove", "random", [&](size_t count) {
+        scarray<node_id> a;
+        for (size_t i = 0; i < count; i++) a.emplace((node_id)i);
+        auto start = bench_clock::now();
+        while (!a.empty()) a.remove(rand_uniform(a.size()), [](node_id) {});
+        return std::chrono::duration<double>(bench_clock::now() - start).count();
+    });
+
+    // graph operations; every deleted edge goes back, so G keeps its edges
+    B.measure("graph_scan", "per edge", [&](size_t count) {
+        size_t rounds = (count + G->num_edges()) / std::max<size_t>(1, G->num_edges());
+        auto start = bench_clock::now();
+        for (size_t r = 0; r < rounds; r++)
+            for (node_id u = 0; u < n; u++)
+                for (node_id v : G->get_neighbourhood(u)) sink += v;
+        keep(sink);
+        double t = std::chrono::duration<double>(bench_clock::now() - start).count();
+        return t * count / std::max<size_t>(1, rounds * G->num_edges());
+    });
+    std::vector<std::pair<node_id, node_id>> edges(1024);
+    if (G->num_edges()) {
+        for (auto &e : edges) e = random_edge(G);
+        B.loop("graph_edge_sno", "", [&](size_t i) { keep(G->get_edge_sno(edges[i % edges.size()].first, edges[i % edges.size()].second)); });
+        B.loop("graph_delete_insert", "", [&](size_t) {
+            auto [u, v] = random_edge(G);
+            G->delete_edge(u, v);
+            G->insert_edge(u, v);
+        });
+    }
+
+    // one walk from a random node
+    Walker W;
+    for (double alpha : {0.2, 0.05})
+        B.loop("random_walk", "alpha=" + Bench::number(alpha), [&](size_t) { sink += W.random_walk(G, rand_uniform(n), alpha); });
+    keep(sink);
+
+    // forward push from random sources, rsv and rsd reset in between
+    FORA<Config> f;
+    RealTimeIndex carrier(G, &C);
+    ppr_vec rsv(n, 0), rsd(n, 0);
+    auto reset = [&](size_t) {
+        std::fill(rsv.begin(), rsv.end(), 0);
+        std::fill(rsd.begin(), rsd.end(), 0);
+    };
+    for (double rmax : {1e-2, 1e-3, 1e-4}) {
+        C.rmax = rmax;
+        B.each("forward_push", "rmax=" + Bench::number(rmax), reset, [&](size_t) { f.forward_push(&carrier, rand_uniform(n), rsv, rsd); });
+    }
+    C.rmax = 0.01;
+
+    // one tree of a StackIndex build, each repetition building a whole index
+    size_t num_trees = C.omega();
+    B.measure("stackindex_build", "per tree", [&](size_t count) {
+        size_t builds = (count + num_trees - 1) / num_trees;
+        double t = 0;
+        for (size_t b = 0; b < builds; b++) {
+            Timer::reset_all();
+            delete new StackIndex(G, &C);
+            t += Timer::used(TIMER::BUILD);
+        }
+        return t * count / (builds * num_trees);
+    });
+
+    // refine over the residues a push from a random source leaves
+    StackIndex *I = new StackIndex(G, &C);
+    std::vector<res_vec> residues(16);
+    for (auto &r : residues) {
+        reset(0);
+        f.forward_push(I, rand_uniform(n), rsv, rsd);
+        r = rsd;
+    }
+    B.each("stackindex_refine", "omega=" + std::to_string(I->num_used_stacks()),
+           [&](size_t i) {
+               std::fill(rsv.begin(), rsv.end(), 0);
+               rsd = residues[i % residues.size()];
+           },
+           [&](size_t) { I->refine(rsv, rsd); });
+
+    // one edge update each, undone untimed before the next
+    if (G->num_edges()) {
+        std::pair<node_id, node_id> e;
+        bool removed = false;
+        auto restore = [&]() {
+            if (removed) f.insert_edge(e.first, e.second, I);
+            removed = false;
+        };
+        B.each("stackindex_update_delete", "",
+               [&](size_t) { restore(); e = random_edge(G); },
+               [&](size_t) { f.delete_edge(e.first, e.second, I); removed = true; });
+        restore();
+        B.each("stackindex_update_insert", "",
+               [&](size_t) { e = random_edge(G); f.delete_edge(e.first, e.second, I); },
+               [&](size_t) { f.insert_edge(e.first, e.second, I); });
+    }
+
+    std::string savepath = savedir + "/" + name + ".json";
+    std::ofstream outfile(savepath);
+    outfile << B.json(graph_json) << std::endl;
+    printf("Saved to %s\n", savepath.c_str());
+
+    delete I;
+    delete G;
+    return 0;
+}
@@ -72,20 +72,28 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    // --memory-budget: stackindex builds stop short of this many MB of trees
     bool force = false;
+    size_t memory_budget = 0;
     for (int i = 4; i < argc; i++) {
         if (strcmp(argv[i], "--force") == 0) {
             force = true;
-            break;
+        } else if (strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc) {
+            memory_budget = std::stoull(argv[++i]) << 20;
         }
     }
 
-    // method can be "stackindex", "rwindex", "realtime"
+    // method can be "stackindex", "stackindex_dynamic", "stackindex_keyed", "rwindex", "realtime"
     std::string method(argv[2]);
 
     std::string savedir(argv[3]);
     ensure_dir(savedir);
     std::string savepath = savedir + "/" + method + ".txt";
+    // stackindex and stackindex_dynamic: bytes per node per tree, the latter
+    // also after dropping the next arrays
+    std::string bytespath = savedir + "/" + method + "_bytes.txt";
+    // memory usage of the graph and every index built, one JSON line each
+    std::string memorypath = savedir + "/" + method + "_memory.jsonl";
 
     int done = 0;
     int xs = 41;
@@ -110,6 +118,7 @@ int main(int argc, char *argv[]) {
 
     
     Config C(true, 0.2, 0.3, 0.1, 0.01, 0.01); // precision (0.3,0.1,0.01,0.01 fixed to make omega 12)
+    C.build_memory_budget = memory_budget;
 
     graph *G = read_graph(argv[1],C);
     FORA<Config> * f = new FORA<Config>; // Invariant: Config is fixed.
@@ -126,6 +135,11 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Failed to open file: %s\n", savepath.c_str());
         return 1;
     }
+    std::ofstream memfile(memorypath, force ? std::ios_base::trunc : std::ios_base::app);
+    std::ofstream bytesfile;
+    if (method == "stackindex" || method == "stackindex_dynamic") {
+        bytesfile.open(bytespath, force ? std::ios_base::trunc : std::ios_base::app);
+    }
 
     std::vector<std::pair<double,double>> time_vec = {};
 
@@ -140,6 +154,11 @@ int main(int argc, char *argv[]) {
         // Define singlesource Solver
         if (method == "stackindex") {
             I.reset(new StackIndex_Static(G, &C)); // 使用reset来分配新的对象
+        } else if (method == "stackindex_dynamic") {
+            C.drop_next = false;
+            I.reset(new StackIndex(G, &C));
+        } else if (method == "stackindex_keyed") {
+            I.reset(new StackIndex_Keyed(G, &C));
         } else if (method == "rwindex") {
             I.reset(new RwIndex(G, &C));
         } else if (method == "realtime") {
@@ -153,12 +172,43 @@ int main(int argc, char *argv[]) {
         time_vec.emplace_back(std::make_pair(alpha,Timer::used(TIMER::BUILD)));
         outfile << std::setprecision(16) << alpha << "\t" << Timer::used(TIMER::BUILD) << std::endl;
 
+        memfile << "{\"alpha\": " << alpha << ", \"rss\": " << rss_bytes()
+                << ", \"graph\": " << G->memory_usage().json()
+                << ", \"index\": " << I->memory_usage().json() << "}" << std::endl;
+
+        if (auto *si = dynamic_cast<StackIndex_Static *>(I.get())) {
+            double bytes = I->memory_usage().total() / ((double)G->num_nodes() * si->stack_index._index.size());
+            printf("alpha:%lf, bytes/node/tree:%lf\n", alpha, bytes);
+            bytesfile << std::setprecision(16) << alpha << "\t" << bytes << std::endl;
+        } else if (auto *si = dynamic_cast<StackIndex *>(I.get())) {
+            double per_node_tree = (double)G->num_nodes() * si->stack_index._index.size();
+            double bytes = I->memory_usage().total() / per_node_tree;
+            si->drop_next();
+            double dropped = I->memory_usage().total() / per_node_tree;
+            printf("alpha:%lf, bytes/node/tree:%lf, without next:%lf\n", alpha, bytes, dropped);
+            bytesfile << std::setprecision(16) << alpha << "\t" << bytes << "\t" << dropped << std::endl;
+        }
+
         // 不需要手动delete I，当I离开作用域或被重新reset时，它指向的对象会自动被删除
     }
 
     printf("Saved to %s\n",savepath.c_str());
     outfile.close();
 
+    // peak RSS of the whole run and the parts of the last index built
+    if (I) {
+        size_t peak = rss_bytes("VmHWM"), rss = rss_bytes();
+        std::ofstream summary(savedir + "/" + method + "_memory.txt");
+        summary << "peak_rss\t" << peak << "\n"
+                << "rss_end\t" << rss << "\n";
+        printf("peak RSS: %zu, RSS: %zu\n", peak, rss);
+        MemoryUsage usage = I->memory_usage();
+        for (auto &p : usage.parts()) {
+            summary << p.name << "_bytes\t" << p.bytes << "\n";
+            printf("%s: %zu bytes, %zu elements\n", p.name.c_str(), p.bytes, p.count);
+        }
+    }
+
 
     delete f;
     delete G;
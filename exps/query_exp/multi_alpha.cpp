@@ -0,0 +1,132 @@
+#include "Index-stackindex.hpp"
+#include "apps/types.hpp"
+#include "fora_skeleton.hpp"
+#include "graph.hpp"
+#include "graph_types.hpp"
+#include "lib/ConvenientPrint.hpp"
+#include "io/file.hpp"
+#include "log/log.h"
+#include "time/timer.hpp"
+#include "exp_util.hpp"
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+
+
+
+graph *read_graph(const char *dataset, Config & C) {
+    fprintf(stdout, "loading meta data\n");
+    auto [n, m, directed] = load_file<graph_meta>(file_path(2, dataset, "meta"));
+    fprintf(stdout, "n = %zu, m = %zu, %s\n", (size_t)n, (size_t)m,
+            directed ? "directed" : "undirected");
+    fflush(stdout);
+
+    fprintf(stdout, "loading base graph\n");
+    fflush(stdout);
+    auto edges = load_file<edge_list>(file_path(2, dataset, "graph"));
+
+    fprintf(stdout, "building base graph\n");
+    fflush(stdout);
+
+    graph *g = new graph(n);
+    for (auto [u, v] : edges) {
+        g->insert_edge(u, v);
+        if (!directed && u != v)
+            g->insert_edge(v, u);
+    }
+
+    C.is_dird = directed;
+
+    return g;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <dataset> <truthdir> <savedir> [--alphas <a1,a2,...>]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<double> alphas = {0.1, 0.15, 0.2};
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--alphas") == 0 && i + 1 < argc) {
+            alphas.clear();
+            for (auto &a : split(argv[++i], ",")) {
+                alphas.push_back(std::stod(a));
+            }
+        }
+    }
+
+    std::string truthdir(argv[2]);
+    std::string savedir(argv[3]);
+    ensure_dir(savedir);
+    std::string savepath = savedir + "/multi_alpha.txt";
+
+    std::ofstream outfile(savepath);
+    if (!outfile.is_open()) {
+        fprintf(stderr, "Failed to open outfile\n");
+        return 1;
+    }
+
+    Config C(true, alphas[0], 0.3, 0.1, 0.01, 0.01); // precision (0.3,0.1,0.01,0.01 fixed to make omega 12)
+    graph *G = read_graph(argv[1],C);
+    FORA<Config> * f = new FORA<Config>;
+
+    std::vector<double> res;
+
+    // average query time and error of I at alpha against the ground truth
+    auto measure = [&](IndexMethod<Config> *I, double alpha) {
+        std::string truthdir_alpha = truthdir + "/" + formatFloat(alpha);
+        std::vector<std::pair<int,std::vector<double>>> truth = read_singlesource_res(truthdir_alpha);
+        std::vector<std::pair<int,std::vector<double>>> estimate = {};
+        std::vector<double> ts = {};
+        for (auto &[s, ppr] : truth) {
+            Timer::reset_all();
+            f->evaluate_noprint(I, s, alpha, [&](const std::vector<double> & ppr){ res = ppr; });
+            estimate.emplace_back(std::make_pair(s, res));
+            ts.emplace_back(Timer::used(TIMER::EVALUATE));
+        }
+        return std::make_pair(avg(ts), avg_singlesource_err(truth, estimate, l1_err));
+    };
+
+    Timer::reset_all();
+    StackIndex_MultiAlpha *M = new StackIndex_MultiAlpha(G, &C, alphas);
+    double shared_build = Timer::used(TIMER::BUILD);
+    size_t shared_bytes = M->memory_usage().total();
+
+    double separate_build = 0;
+    size_t separate_bytes = 0;
+    for (double alpha : alphas) {
+        C.alpha = alpha;
+        Timer::reset_all();
+        StackIndex *I = new StackIndex(G, &C);
+        double t_build = Timer::used(TIMER::BUILD);
+        size_t bytes = I->memory_usage().total();
+        separate_build += t_build;
+        separate_bytes += bytes;
+
+        auto [t_sep, err_sep] = measure(I, alpha);
+        delete I;
+        auto [t_shared, err_shared] = measure(M, alpha);
+
+        // alpha, separate: build time, bytes, query time, error, shared: query time, error
+        std::cout << std::setprecision(16) << alpha << "\t" << t_build << "\t" << bytes << "\t" << t_sep << "\t" << err_sep
+                  << "\t" << t_shared << "\t" << err_shared << std::endl;
+        outfile << std::setprecision(16) << alpha << "\t" << t_build << "\t" << bytes << "\t" << t_sep << "\t" << err_sep
+                << "\t" << t_shared << "\t" << err_shared << std::endl;
+    }
+
+    printf("separate: build %lf s, %zu bytes; shared: build %lf s, %zu bytes (%.3fx memory)\n",
+           separate_build, separate_bytes, shared_build, shared_bytes, (double)shared_bytes / separate_bytes);
+    outfile << "total" << "\t" << separate_build << "\t" << separate_bytes << "\t" << shared_build << "\t" << shared_bytes << std::endl;
+
+    printf("Saved to %s\n", savepath.c_str());
+    outfile.close();
+
+    delete M;
+    delete f;
+    delete G;
+    return 0;
+}
@@ -63,15 +63,17 @@ void handle_workload(char *argv[], std::string workload, bool output) {
 
 int main(int argc, char *argv[]) {
     if (argc < 6) {
-        fprintf(stderr, "Usage: %s <dataset> <alpha> <method> <truthdir> <savedir> \n", argv[0]);
+        fprintf(stderr, "Usage: %s <dataset> <alpha> <method> <truthdir> <savedir> [--force] [--progressive <batch>]\n", argv[0]);
         return 1;
     }
 
     bool force = false;
+    size_t batch = 0; // when set, also trace progressive queries refining batch samples at a time
     for (int i = 6; i < argc; i++) {
         if (strcmp(argv[i], "--force") == 0) {
             force = true;
-            break;
+        } else if (strcmp(argv[i], "--progressive") == 0 && i + 1 < argc) {
+            batch = atoi(argv[++i]);
         }
     }
 
@@ -117,12 +119,23 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    // one JSON line per eps with the query counters and latencies, see
+    // time/metrics.hpp; they stay zero unless built with METRICS
+    std::ofstream metricsfile(savedir + "/" + method + "_metrics.jsonl", force ? std::ios::out : std::ios::app);
+    // and with the hardware counters of push and refine, see time/perf_counters.hpp
+    std::ofstream perffile(savedir + "/" + method + "_perf.jsonl", force ? std::ios::out : std::ios::app);
+
+    std::ofstream progfile;
+    if(batch){
+        progfile.open(savedir + "/" + method + "_progressive.txt", force ? std::ios::out : std::ios::app);
+    }
+
     Config C(true, 0.2, 0.3, 0.1, 0.01, 0.01); // precision (0.3,0.1,0.01,0.01 fixed to make omega 12)
     graph *G = read_graph(argv[1],C);
     double alpha = atof(argv[2]);
     C.alpha = alpha;
     FORA<Config> * f = new FORA<Config>; 
-    IndexMethod<Config> * I;
+    IndexMethod<Config> * I = nullptr;
 
     std::vector<std::pair<int,std::vector<double>>> truth = read_singlesource_res(truthdir);
     std::vector<int> sources = {};
@@ -135,6 +148,19 @@ int main(int argc, char *argv[]) {
         res = std::move(ppr);
     };
 
+    // a stack index is built once at the smallest eps left, i.e. the largest
+    // omega; every other eps refines over a prefix of its trees
+    IndexMethod<Config> * nested = nullptr;
+    if (method == "stackindex") {
+        C.eps = 1;
+        for(auto eps:epss){
+            if(!d_is_in(eps,done)) C.eps = std::min(C.eps, eps);
+        }
+        Timer::reset_all();
+        nested = new StackIndex_Static(G, &C);
+        printf("built once at eps %lf, build time: %lf\n", C.eps, Timer::used(TIMER::BUILD));
+    }
+
     for(auto eps:epss)
     {
         printf("eps: %lf\n",eps);
@@ -147,8 +173,8 @@ int main(int argc, char *argv[]) {
         C.eps = eps;
 
         // Define singlesource Solver
-        if (method == "stackindex") {
-            I = new StackIndex_Static(G, &C);
+        if (nested) {
+            I = nested;
         } else if (method == "rwindex") {
             I = new RwIndex(G, &C);
         } else if (method == "realtime") {
@@ -166,6 +192,8 @@ int main(int argc, char *argv[]) {
         std::vector<std::pair<int,std::vector<double>>> estimate = {};
 
         std::vector<double> ts = {};
+        Metrics::reset();
+        PerfCounters::reset();
         for(int i=0;i<sources.size();++i){
             Timer::reset_all();
             int s = sources[i];
@@ -181,12 +209,42 @@ int main(int argc, char *argv[]) {
         double avg_t = avg(ts);
         std::cout << std::setprecision(16) << eps << "\t" << avg_t << "\t" << avg_err << std::endl;
         outfile << std::setprecision(16) << eps << "\t" << avg_t << "\t" << avg_err << std::endl;
+        metricsfile << std::setprecision(16) << "{\"eps\": " << eps << ", \"metrics\": " << Timer::metrics_json() << "}" << std::endl;
+        perffile << std::setprecision(16) << "{\"eps\": " << eps << ", \"perf\": " << Timer::perf_json() << "}" << std::endl;
+
+        if(batch){
+            // per batch, averaged over sources: samples used, elapsed time, l1 error, top-10 bound
+            std::vector<size_t> ks;
+            std::vector<double> pts, perrs, pbounds;
+            for(auto &[s, ppr] : truth){
+                Timer::reset_all();
+                size_t b = 0;
+                f->evaluate_progressive(I, s, batch, 0.05, [&](size_t k, const ppr_vec &est, const std::vector<double> &bound){
+                    if(b == ks.size()){
+                        ks.push_back(k);
+                        pts.push_back(0);
+                        perrs.push_back(0);
+                        pbounds.push_back(0);
+                    }
+                    pts[b] += Timer::used(TIMER::PUSH) + Timer::used(TIMER::REFINE);
+                    perrs[b] += l1_err(ppr, est);
+                    pbounds[b] += FORA<Config>::topk_bound(est, bound, 10);
+                    b++;
+                    return true;
+                });
+            }
+            for(size_t b = 0; b < ks.size(); b++){
+                progfile << std::setprecision(16) << eps << "\t" << ks[b] << "\t" << pts[b] / truth.size()
+                         << "\t" << perrs[b] / truth.size() << "\t" << pbounds[b] / truth.size() << std::endl;
+            }
+        }
+        if (I != nested) delete I;
     }
     
     printf("Saved to %s\n", savepath.c_str());
 
     delete f;
-    delete I;
+    delete nested;
     delete G;
     int a;
     return 0;
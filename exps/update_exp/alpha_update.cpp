@@ -66,19 +66,27 @@ void handle_workload(char *argv[], std::string workload, bool output) {
 int main(int argc, char *argv[]) {
     int min_args = 5;
     if (argc < min_args) {
-        fprintf(stderr, "Usage: %s <dataset> <method> <truthdir> <savedir>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <dataset> <method> <truthdir> <savedir> [--force] [--rebuild] [--threads <t1,t2,...>]\n", argv[0]);
         return 1;
     }
 
     bool force = false;
+    bool rebuild = false; // also time a from-scratch build at each alpha to report the update speedup
+    std::vector<size_t> threads = {1}; // the first count serves the main run; with several, every count is swept
     for (int i = min_args; i < argc; i++) {
         if (strcmp(argv[i], "--force") == 0) {
             force = true;
-            break;
+        } else if (strcmp(argv[i], "--rebuild") == 0) {
+            rebuild = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads.clear();
+            for (auto &t : split(argv[++i], ",")) {
+                threads.push_back(std::max(1, std::stoi(t)));
+            }
         }
     }
 
-    // method can be "stackindex", "rwindex", "realtime"
+    // method can be "stackindex", "stackindex_dynamic", "rwindex", "realtime"
     std::string method(argv[2]);
 
     std::string truthdir(argv[3]);
@@ -106,7 +114,7 @@ int main(int argc, char *argv[]) {
                 break;
             }
         }
-        if(all_done){
+        if(all_done && threads.size() == 1){
             printf("All done.\n");
             return 0;
         }
@@ -125,35 +133,52 @@ int main(int argc, char *argv[]) {
 
     // Config C(true, 0.2, 0.1, 0.05, 0.05, 0.01);
     Config C(true, 0.2, 0.3, 0.1, 0.01, 0.01); // precision (0.3, 0.1, 0.01, 0.01 fixed to make omega 12)
+    C.num_threads = threads[0];
     graph *G = read_graph(argv[1],C);
     FORA<Config> * f = new FORA<Config>; 
-    IndexMethod<Config> * I;
+    IndexMethod<Config> * I = nullptr;
+
+    auto build = [&]() -> IndexMethod<Config> * {
+        if (method == "stackindex") {
+            return new StackIndex_Static(G, &C);
+        } else if (method == "stackindex_dynamic") {
+            return new StackIndex(G, &C);
+        } else if (method == "rwindex") {
+            return new RwIndex(G, &C);
+        } else if (method == "realtime") {
+            return new RealTimeIndex(G, &C);
+        }
+        return nullptr;
+    };
 
     std::vector<double> res;
     auto outputer = [&](const std::vector<double> & ppr){
         res = std::move(ppr);
     };
 
+    // one JSON line per alpha with the hardware counters of its build or
+    // update and of its queries, and with --rebuild one more for the
+    // comparison build, see time/perf_counters.hpp
+    std::ofstream perffile(savedir + "/" + method + "_perf.jsonl", force ? std::ios::out : std::ios::app);
+
     for(size_t i=done.size();i < alphas.size();++i)
     {
         double alpha = alphas[i];
         printf("alpha: %lf\n",alpha);
+        PerfCounters::reset();
         double t;
+        double t_rebuild = 0;
         // Define singlesource Solver
         if(i == done.size()){
             C.alpha = alpha;
             Timer::reset_all();
-            if (method == "stackindex") {
-                I = new StackIndex_Static(G, &C);
-            } else if (method == "rwindex") {
-                I = new RwIndex(G, &C);
-            } else if (method == "realtime") {
-                I = new RealTimeIndex(G, &C);
-            } else {
+            I = build();
+            if (I == nullptr) {
                 fprintf(stderr, "Unknown method: %s\n", method.c_str());
                 return 1;
             }
             t = Timer::used(TIMER::BUILD);
+            t_rebuild = t;
             printf("Time:%lf\n",t);
         } else{
             Timer::reset_all();
@@ -194,12 +219,53 @@ int main(int argc, char *argv[]) {
             return -1;
         }
         
-        std::cout << std::setprecision(16) << alpha << "\t" << t << "\t" << avg_err << std::endl;
-        outfile << std::setprecision(16) << alpha << "\t" << t << "\t" << avg_err << std::endl;
+        perffile << std::setprecision(16) << "{\"alpha\": " << alpha << ", \"perf\": " << Timer::perf_json() << "}" << std::endl;
+        if(rebuild && i > done.size()){
+            // a from-scratch build at the updated alpha, timed and counted
+            // apart from the update and its queries, in a record of its own
+            PerfCounters::reset();
+            Timer::reset_all();
+            delete build();
+            t_rebuild = Timer::used(TIMER::BUILD);
+            printf("update:%lf, rebuild:%lf, speedup:%lf\n", t, t_rebuild, t_rebuild / t);
+            perffile << std::setprecision(16) << "{\"alpha\": " << alpha << ", \"rebuild\": true, \"perf\": " << Timer::perf_json() << "}" << std::endl;
+        }
+
+        std::cout << std::setprecision(16) << alpha << "\t" << t << "\t" << avg_err;
+        outfile << std::setprecision(16) << alpha << "\t" << t << "\t" << avg_err;
+        if(rebuild){
+            std::cout << "\t" << t_rebuild << "\t" << t_rebuild / t;
+            outfile << "\t" << t_rebuild << "\t" << t_rebuild / t;
+        }
+        std::cout << std::endl;
+        outfile << std::endl;
     }
     
     printf("Saved to %s\n", savepath.c_str());
 
+    if(threads.size() > 1){
+        // replay the alpha sweep for every thread count, timing the updates only
+        std::string threadpath = savedir + "/" + method + "_threads.txt";
+        std::ofstream threadfile(threadpath);
+        std::vector<double> base_ts(alphas.size(), 0);
+        for(size_t k : threads){
+            C.num_threads = k;
+            C.alpha = alphas[0];
+            delete I;
+            I = build();
+            for(size_t i=1;i<alphas.size();++i){
+                Timer::reset_all();
+                I->update_alpha(alphas[i]);
+                double t = Timer::used(TIMER::UPDATE);
+                if(k == threads[0]) base_ts[i] = t;
+                printf("alpha:%lf, threads:%zu, update:%lf, speedup:%lf\n", alphas[i], k, t, base_ts[i] / t);
+                threadfile << std::setprecision(16) << alphas[i] << "\t" << k << "\t" << t << "\t" << base_ts[i] / t << std::endl;
+            }
+        }
+        threadfile.close();
+        printf("Saved to %s\n", threadpath.c_str());
+    }
+
     delete f;
     delete I;
     delete G;
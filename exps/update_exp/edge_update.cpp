@@ -9,7 +9,9 @@
 #include "lib/ConvenientPrint.hpp"
 #include "io/file.hpp"
 #include "log/log.h"
+#include "time/telemetry.hpp"
 #include "time/timer.hpp"
+#include "time/trace.hpp"
 #include "exp_util.hpp"
 #include <cstdio>
 #include <cstring>
@@ -57,13 +59,41 @@ std::vector<update> read_workload(const char* dataset, std::string workload) {
 
 int main(int argc, char *argv[]) {
     if (argc < 5) {
-        fprintf(stderr, "Usage: %s <dataset> <method> <workload> <savedir>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <dataset> <method> <workload> <savedir> [--lazy] [--repair-threads <t>] [--threads <t>] [--per-tree-insert] [--unfused] [--memory-target <MB>] [--compact] [--memory-every <n>] [--trace <file>]\n", argv[0]);
         return 1;
     }
 
+    // --lazy: stackindex only marks the trees an update touches and repairs
+    // them when a query first reads them
+    // --repair-threads: stackindex hands those trees to background workers
+    // --threads: stackindex repairs the trees of one update in parallel
+    // --per-tree-insert: stackindex draws for every tree on insert instead of
+    // skipping to the affected ones, as a baseline for RNG calls and time
+    // --unfused: stackindex repairs an undirected edge once per direction
+    // --memory-target: stackindex shrinks stack columns while above it
+    // --compact: stackindex compacts all stacks after the workload
+    // --memory-every: also snapshot the memory usage every n operations
+    // --trace: write a Chrome trace-event timeline of the build, every
+    // operation with its timed phases and every tree repair to file
+    bool lazy = false, per_tree_insert = false, unfused = false, compact = false;
+    size_t memory_target = 0, memory_every = 0;
+    size_t repair_threads = 0, num_threads = 1;
+    std::string tracepath;
+    for (int i = 5; i < argc; i++) {
+        if (strcmp(argv[i], "--lazy") == 0) lazy = true;
+        else if (strcmp(argv[i], "--repair-threads") == 0 && i + 1 < argc) repair_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) num_threads = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--per-tree-insert") == 0) per_tree_insert = true;
+        else if (strcmp(argv[i], "--unfused") == 0) unfused = true;
+        else if (strcmp(argv[i], "--memory-target") == 0 && i + 1 < argc) memory_target = atof(argv[++i]) * (1 << 20);
+        else if (strcmp(argv[i], "--compact") == 0) compact = true;
+        else if (strcmp(argv[i], "--memory-every") == 0 && i + 1 < argc) memory_every = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) tracepath = argv[++i];
+    }
+
     std::string dataset(argv[1]);
 
-    // method can be "stackindex", "rwindex", "realtime"
+    // method can be "stackindex", "stackindex_keyed", "rwindex", "realtime"
     std::string method(argv[2]);
 
     std::string workload(argv[3]);
@@ -73,20 +103,35 @@ int main(int argc, char *argv[]) {
     savedir += "/" + workload;
     ensure_dir(savedir);
 
-    std::string savepath = savedir + "/" + method + ".txt";
+    std::string tag = method;
+    if (repair_threads > 0) tag += "_async" + std::to_string(repair_threads);
+    else if (lazy) tag += "_lazy";
+    else if (num_threads > 1) tag += "_t" + std::to_string(num_threads);
+    if (per_tree_insert) tag += "_pertree";
+    if (unfused) tag += "_unfused";
+    std::string savepath = savedir + "/" + tag + ".txt";
     std::ofstream outfile;
     outfile.open(savepath);
 
     std::vector<update> w = read_workload(argv[1],workload);
 
     Config C(true, 0.2, 0.3, 0.1, 0.01, 0.01);
+    C.lazy_repair = lazy;
+    C.repair_threads = repair_threads;
+    C.num_threads = num_threads;
+    C.skip_insert_sampling = !per_tree_insert;
+    C.fuse_undirected = !unfused;
+    C.stack_memory_target = memory_target;
     graph *G = read_base_graph(argv[1],C);
     FORA<Config> * f = new FORA<Config>; 
     IndexMethod<Config> * I;
+    if (!tracepath.empty()) Trace::start();
 
     // Define singlesource Solver
     if (method == "stackindex") {
         I = new StackIndex(G, &C);
+    } else if (method == "stackindex_keyed") {
+        I = new StackIndex_Keyed(G, &C);
     } else if (method == "rwindex") {
         I = new windex_inc(G,C.is_dird, C);
     } else if (method == "realtime") {
@@ -96,14 +141,51 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    size_t rss_build = rss_bytes();
+    StackIndex *si = dynamic_cast<StackIndex *>(I);
+    size_t bytes_build = I->memory_usage().total();
+
+    // one JSON line per snapshot: after build, every memory_every
+    // operations and after the workload
+    std::string memorypath = savedir + "/" + tag + "_memory.jsonl";
+    std::ofstream memfile(memorypath);
+    size_t num_ops = 0;
+    auto snapshot = [&]() {
+        memfile << "{\"op\": " << num_ops << ", \"rss\": " << rss_bytes()
+                << ", \"graph\": " << G->memory_usage().json()
+                << ", \"index\": " << I->memory_usage().json() << "}" << std::endl;
+    };
+    snapshot();
+    // build-time structural telemetry, see time/telemetry.hpp; the rest
+    // covers the workload
+    std::string telemetry_build = Telemetry::json();
+    Telemetry::reset();
+    // hardware counters per phase, see time/perf_counters.hpp, likewise
+    std::string perf_build = Timer::perf_json();
+    PerfCounters::reset();
+
     std::vector<double> res;
     auto outputer = [&](const std::vector<double> & ppr){
         res = std::move(ppr);
     };
 
 
+    // repairs are timed wherever they happen (inside updates when eager,
+    // inside queries when lazy), so the amortized update cost charges the
+    // repairs paid by queries back to the updates that caused them
+    size_t num_updates = 0, num_queries = 0, num_inserts = 0;
+    double update_time = 0, query_time = 0, query_repair_time = 0, insert_time = 0;
+    // background repair queue depth, sampled after every update
+    RepairPool *pool = nullptr;
+    if (si) pool = si->repair_pool.get();
+    size_t queue_depth_sum = 0;
+
     for (auto [o, u, v] : w) {
       Timer::reset_all();
+      TraceSpan span(o == '?' ? "query" : o == '+' ? "insert" : "delete", "op");
+      span.arg("op", num_ops);
+      span.arg("u", u);
+      span.arg("v", v);
       // I->conf->is_dird = C.is_dird;
       // I->conf->alpha = C.alpha;
       if (o == '?') {
@@ -112,6 +194,9 @@ int main(int argc, char *argv[]) {
         printf("querying source %zu\n", (size_t)s);
         f->evaluate_noprint(I, s, outputer);
         double t = Timer::used(TIMER::EVALUATE);
+        num_queries++;
+        query_time += t;
+        query_repair_time += Timer::used(TIMER::REPAIR);
         std::cout << std::setprecision(16) << o << "\t" << t << std::endl;
         outfile << std::setprecision(16) << o << "\t" << t << std::endl;
       } else if (o == '+') {
@@ -119,6 +204,11 @@ int main(int argc, char *argv[]) {
         printf("inserting edge %zu %zu\n", (size_t)u, (size_t)v);
         f->insert_edge(u, v, I);
         double t = Timer::used(TIMER::UPDATE);
+        num_updates++;
+        update_time += t;
+        num_inserts++;
+        insert_time += t;
+        if (pool) queue_depth_sum += pool->stats().queue_depth;
         std::cout << std::setprecision(16) << o << "\t" << t << std::endl;
         outfile << std::setprecision(16) << o << "\t" << t << std::endl;
       } else if (o == '-') {
@@ -126,15 +216,95 @@ int main(int argc, char *argv[]) {
         printf("deleting edge %zu %zu\n", (size_t)u, (size_t)v);
         f->delete_edge(u, v, I);
         double t = Timer::used(TIMER::UPDATE);
+        num_updates++;
+        update_time += t;
+        if (pool) queue_depth_sum += pool->stats().queue_depth;
         std::cout << std::setprecision(16) << o << "\t" << t << std::endl;
         outfile << std::setprecision(16) << o << "\t" << t << std::endl;
       } else {
         log_error("unknown operation %c", o);
       }
+      num_ops++;
+      if (memory_every && num_ops % memory_every == 0) snapshot();
     }
     
     printf("Saved to %s\n", savepath.c_str());
 
+    size_t rss_end = rss_bytes(), rss_compact = 0, compacted = 0;
+    size_t bytes_end = I->memory_usage().total();
+    snapshot();
+    if (si && compact) {
+        compacted = si->compact();
+        rss_compact = rss_bytes();
+    }
+
+    // query counters and per-phase latencies over the whole run, see
+    // time/metrics.hpp; they stay zero unless built with METRICS
+    std::ofstream metricsfile(savedir + "/" + tag + "_metrics.json");
+    metricsfile << Timer::metrics_json() << std::endl;
+    std::ofstream telemetryfile(savedir + "/" + tag + "_telemetry.json");
+    telemetryfile << "{\"build\": " << telemetry_build << ", \"workload\": " << Telemetry::json() << "}" << std::endl;
+    std::ofstream perffile(savedir + "/" + tag + "_perf.json");
+    perffile << "{\"build\": " << perf_build << ", \"workload\": " << Timer::perf_json() << "}" << std::endl;
+
+    if (!tracepath.empty()) {
+        // background repairs are held back while the buffers are merged
+        if (pool) pool->begin_update();
+        if (Trace::write(tracepath)) printf("Trace saved to %s\n", tracepath.c_str());
+        else fprintf(stderr, "Failed to write trace %s\n", tracepath.c_str());
+        if (pool) pool->end_update();
+    }
+
+    std::string summarypath = savedir + "/" + tag + "_summary.txt";
+    std::ofstream summary(summarypath);
+    double amortized = num_updates ? (update_time + query_repair_time) / num_updates : 0;
+    summary << std::setprecision(16)
+            << "updates\t" << num_updates << "\n"
+            << "queries\t" << num_queries << "\n"
+            << "update_time\t" << update_time << "\n"
+            << "query_time\t" << query_time << "\n"
+            << "query_repair_time\t" << query_repair_time << "\n"
+            << "amortized_update_cost\t" << amortized << "\n"
+            << "inserts\t" << num_inserts << "\n"
+            << "insert_time\t" << insert_time << "\n";
+    summary << "rss_build\t" << rss_build << "\n"
+            << "rss_end\t" << rss_end << "\n";
+    printf("RSS after build: %zu, after workload: %zu\n", rss_build, rss_end);
+    summary << "index_bytes_build\t" << bytes_build << "\n"
+            << "index_bytes_end\t" << bytes_end << "\n";
+    printf("index bytes after build: %zu, after workload: %zu\n", bytes_build, bytes_end);
+    if (si && compact) {
+        summary << "compacted_bytes\t" << compacted << "\n"
+                << "rss_compact\t" << rss_compact << "\n";
+        printf("compaction released %zu bytes of stacks, RSS after compaction: %zu\n", compacted, rss_compact);
+    }
+    if (si) {
+        summary << "insert_rng_calls\t" << si->insert_rng_calls << "\n"
+                << "repair_choices\t" << si->repair_choices << "\n"
+                << "resample_choices\t" << si->resample_choices << "\n"
+                << "restack_cost_model\t" << si->restack_cost.c[0] << "\t" << si->restack_cost.c[1]
+                << "\t" << si->restack_cost.c[2] << "\n";
+        printf("updates repaired: %zu, resampled: %zu, restack cost model: %.3g + %.3g/read + %.3g/draw\n",
+               si->repair_choices, si->resample_choices, si->restack_cost.c[0], si->restack_cost.c[1], si->restack_cost.c[2]);
+        printf("inserts: %zu, insert time: %.9lf, insert RNG calls: %zu\n", num_inserts, insert_time, si->insert_rng_calls);
+    }
+    if (pool) {
+        RepairPool::Stats st = pool->stats();
+        size_t repairs = st.repairs + st.caller_repairs;
+        summary << "avg_queue_depth\t" << (num_updates ? (double)queue_depth_sum / num_updates : 0) << "\n"
+                << "max_queue_depth\t" << st.max_queue_depth << "\n"
+                << "background_repairs\t" << st.repairs << "\n"
+                << "query_repairs\t" << st.caller_repairs << "\n"
+                << "background_repair_time\t" << st.repair_time << "\n"
+                << "avg_repair_lag\t" << (repairs ? st.lag_sum / repairs : 0) << "\n"
+                << "max_repair_lag\t" << st.lag_max << "\n";
+        printf("max queue depth: %zu, repairs: %zu background / %zu by queries, max repair lag: %.9lf\n",
+               st.max_queue_depth, st.repairs, st.caller_repairs, st.lag_max);
+    }
+    printf("updates: %zu, queries: %zu, amortized update cost: %.9lf, query repair time: %.9lf\n",
+           num_updates, num_queries, amortized, query_repair_time);
+    printf("Saved to %s\n", summarypath.c_str());
+
     delete f;
     delete I;
     delete G;
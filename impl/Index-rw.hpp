@@ -20,8 +20,21 @@
 
 class RwIndex:public simple_walk, public IndexMethod<Config>{
 private:
+    // records[s][j] is the terminal of the j-th walk from s. Walks are keyed
+    // by (seed, s, j) and replayed on demand, so no path is stored per walk.
     std::vector<std::vector<node_id>> records;
     size_t num_walks = 0;
+    uint64_t seed = ((uint64_t)rand_uint() << 32) | rand_uint();
+
+    uint64_t walk_key(node_id s, size_t j) const {
+        return rand_keyed(seed, (uint64_t)s * num_walks + j);
+    }
+
+    // the walk length is drawn from counter 0 of the walk key, hence is
+    // coupled across alphas; steps use counters 1, 2, ...
+    uint32_t walk_leng(uint64_t key, double alpha) const {
+        return rand_keyed_geometric(key, 0, alpha);
+    }
     
 public:
     RwIndex(graph *G, Config *conf) : IndexMethod(G, conf) {
@@ -31,15 +44,25 @@ public:
 
         Timer tmr(TIMER::BUILD);
         for (node_id i = 0; i < G->num_nodes(); i++) {
-            if(i % 10000 == 0){
-                // printf("i: %u\n", i);
-            }
-            for(size_t _ = 0; _ < num_walks; _++){
-                records[i].push_back(random_walk(G, i, conf->alpha));
+            records[i].reserve(num_walks);
+            for(size_t j = 0; j < num_walks; j++){
+                uint64_t key = walk_key(i, j);
+                records[i].push_back(replay_walk(G, i, key, 0, walk_leng(key, conf->alpha)));
             }
         }
     }
 
+    MemoryUsage memory_usage() const {
+        MemoryUsage usage;
+        size_t bytes = records.capacity() * sizeof(std::vector<node_id>), walks = 0;
+        for(auto &r : records){
+            bytes += r.capacity() * sizeof(node_id);
+            walks += r.size();
+        }
+        usage.add("records", bytes, walks);
+        return usage;
+    }
+
     void refine(ppr_vec &reserve, res_vec &residue) {
         for(node_id i = 0; i < G->num_nodes(); i++){
             for(auto ter:records[i]){
@@ -48,17 +71,34 @@ public:
         }
     }
 
+    // the j-th walk of every node forms the j-th sample
+    size_t num_samples() const {
+        return num_walks;
+    }
+
+    void refine_sample(size_t j, ppr_vec &reserve, const res_vec &residue) {
+        for(node_id i = 0; i < G->num_nodes(); i++){
+            if(residue[i] != 0) reserve[records[i][j]] += residue[i];
+        }
+    }
+
+    // Reuse every walk under the new alpha: a walk that gets longer resumes
+    // from its terminal, one that gets shorter is replayed up to its new length.
     void update_alpha(double alpha) {
         Timer tmr(TIMER::UPDATE);
 
+        double old_alpha = conf->alpha;
         conf->alpha = alpha;
-        records = std::vector<std::vector<node_id>>(G->num_nodes(),std::vector<node_id>());
         for (node_id i = 0; i < G->num_nodes(); i++) {
-            if(i % 10000 == 0){
-                // printf("i: %u\n", i);
-            }
-            for(size_t _ = 0; _ < num_walks; _++){
-                records[i].push_back(random_walk(G, i, conf->alpha));
+            for(size_t j = 0; j < num_walks; j++){
+                uint64_t key = walk_key(i, j);
+                uint32_t old_leng = walk_leng(key, old_alpha);
+                uint32_t new_leng = walk_leng(key, alpha);
+                if(new_leng >= old_leng){
+                    records[i][j] = replay_walk(G, records[i][j], key, old_leng, new_leng);
+                } else{
+                    records[i][j] = replay_walk(G, i, key, 0, new_leng);
+                }
             }
         }
     }
@@ -3,14 +3,22 @@
 #include "fora_skeleton.hpp"
 #include "graph.hpp"
 #include "lib/ConvenientPrint.hpp"
+#include "lib/packed_array.hpp"
+#include "lib/parallel.hpp"
 #include "lib/random.hpp"
+#include "lib/repair_pool.hpp"
 #include "log/log.h"
+#include "time/telemetry.hpp"
 #include "time/timer.hpp"
+#include "time/trace.hpp"
 #include "uniqueue.hpp"
 #include <algorithm>
 #include <assert.h>
 #include <cmath>
+#include <atomic>
 #include <cstdio>
+#include <malloc.h>
+#include <memory>
 #include <stdexcept>
 #include <unordered_map>
 #include <unordered_set>
@@ -21,50 +29,365 @@
 
 
 
+// Least-squares fit of restack time t ~ c0 + c_read * reads + c_draw * draws,
+// refitted after every sample.
+class RestackCostModel {
+public:
+    void add(double reads, double draws, double t) {
+        double x[3] = {1, reads, draws};
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) xx[i][j] += x[i] * x[j];
+            xt[i] += x[i] * t;
+        }
+        num_samples++;
+        fit();
+    }
+
+    double predict(double reads, double draws) const {
+        return c[0] + c[1] * reads + c[2] * draws;
+    }
+
+    bool calibrated() const { return num_samples >= 16; }
+
+    double c[3] = {0, 0, 0};
+    size_t num_samples = 0;
+
+private:
+    void fit() {
+        // normal equations with a small ridge, by Gaussian elimination
+        double a[3][4];
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) a[i][j] = xx[i][j];
+            a[i][i] += 1e-9 * (xx[i][i] + 1);
+            a[i][3] = xt[i];
+        }
+        for (int k = 0; k < 3; k++) {
+            int p = k;
+            for (int i = k + 1; i < 3; i++) if (std::abs(a[i][k]) > std::abs(a[p][k])) p = i;
+            std::swap(a[k], a[p]);
+            if (a[k][k] == 0) return;
+            for (int i = 0; i < 3; i++) {
+                if (i == k) continue;
+                double f = a[i][k] / a[k][k];
+                for (int j = k; j < 4; j++) a[i][j] -= f * a[k][j];
+            }
+        }
+        for (int i = 0; i < 3; i++) c[i] = a[i][3] / a[i][i];
+    }
+
+    double xx[3][3] = {};
+    double xt[3] = {};
+};
+
+
+// Components of a stack forest, rebuilt from next (-1 at the roots) after
+// every change. Per node only its component id and a link of the circular
+// list through its component are kept; the root and the integer volume
+// (sum of degrees) of a component sit in side tables of one entry per root.
+class Components {
+public:
+    std::vector<node_id> comp;
+    std::vector<node_id> link;
+    std::vector<node_id> head;
+    std::vector<uint64_t> vol;
+
+    void build(graph *G, const std::vector<node_id> &next) {
+        node_id n = G->num_nodes();
+        comp.assign(n, -1);
+        link.resize(n);
+        head.clear();
+        vol.clear();
+        for(node_id u=0;u<n;u++){
+            if(next[u] != (node_id)-1) continue;
+            comp[u] = head.size();
+            head.push_back(u);
+            vol.push_back(G->get_degree(u));
+            link[u] = u;
+        }
+        for(node_id u=0;u<n;u++){
+            if(comp[u] != (node_id)-1) continue;
+            node_id p = u;
+            while(comp[p] == (node_id)-1) p = next[p];
+            node_id c = comp[p], h = head[c];
+            for(p=u;comp[p] == (node_id)-1;p=next[p]){
+                comp[p] = c;
+                vol[c] += G->get_degree(p);
+                link[p] = link[h];
+                link[h] = p;
+            }
+        }
+        head.shrink_to_fit();
+        vol.shrink_to_fit();
+#ifdef TELEMETRY
+        for(node_id h : head) telemetry_add(HIST::COMPONENT_SIZE, size(h));
+#endif
+    }
+
+    node_id root(node_id u) const {
+        return head[comp[u]];
+    }
+
+    uint64_t volume(node_id u) const {
+        return vol[comp[u]];
+    }
+
+    // the degree of u changed by delta; refine divides current degrees by
+    // the volume, so it follows even while the tree is not rebuilt
+    void adjust(node_id u, int64_t delta) {
+        vol[comp[u]] += delta;
+    }
+
+    // nodes in the component of u
+    size_t size(node_id u) const {
+        size_t n = 0;
+        for_each(u, [&](node_id){ n++; });
+        return n;
+    }
+
+    // f(v) for every node v in the component of u
+    template <class F>
+    void for_each(node_id u, F f) const {
+        node_id h = head[comp[u]], v = h;
+        do{
+            f(v);
+            v = link[v];
+        } while(v != h);
+    }
+
+    size_t bytes() const {
+        return (comp.capacity() + link.capacity() + head.capacity()) * sizeof(node_id) + vol.capacity() * sizeof(uint64_t);
+    }
+
+    // the per-node arrays as "components", the root tables as "components/roots"
+    void add_usage(MemoryUsage &usage) const {
+        usage.add("components", (comp.capacity() + link.capacity()) * sizeof(node_id), comp.size());
+        usage.add("components/roots", head.capacity() * sizeof(node_id) + vol.capacity() * sizeof(uint64_t), head.size());
+    }
+};
+
+
 class StackIndex : public IndexMethod<Config> {
 public:
+    // Stack of a node u: its entries are slots of u's adjacency (NONE for a
+    // termination) rather than node ids, stored `width` bytes each. A stack
+    // starts one byte wide and widens itself the first time a slot does not
+    // fit, so nodes of degree below 255 keep a byte per entry; up to 16
+    // bytes of entries live inline, longer stacks on the heap.
     class Stack{
+        static constexpr uint32_t INLINE = 16;
     public:
-        size_t top = 0;
-        std::vector<node_id> column;
-        node_id& operator[](size_t index){
-            if (index >= column.size()) {
-                fprintf(stdout, "Index: %zu, size: %zu\n", index, column.size());
+        static constexpr uint32_t NONE = UINT32_MAX;
+
+        uint32_t top = 0;
+    private:
+        // heap bytes (INLINE while the entries are in buf) and log2 of the
+        // entry width, packed next to top to keep a stack at 32 bytes
+        uint32_t cap : 30;
+        uint32_t wlog : 2;
+    public:
+        // One-hash Bloom filter of the slots in [0, top): pushes and writes
+        // add bits and truncations leave them, so it only over-approximates
+        // until a scan in redraw() rebuilds it.
+        uint64_t filter = 0;
+
+        Stack() : cap(INLINE), wlog(0) {}
+        Stack(const Stack &o) : top(o.top), cap(o.cap), wlog(o.wlog), filter(o.filter) {
+            if(o.on_heap()){
+                heap = (uint8_t *)malloc(cap);
+                memcpy(heap, o.heap, top * width());
+            } else{
+                memcpy(buf, o.buf, INLINE);
+            }
+        }
+        Stack(Stack &&o) noexcept : top(o.top), cap(o.cap), wlog(o.wlog), filter(o.filter) {
+            memcpy(buf, o.buf, INLINE);
+            o.top = 0;
+            o.cap = INLINE;
+        }
+        Stack &operator=(Stack o) noexcept {
+            std::swap(top, o.top);
+            std::swap(filter, o.filter);
+            uint32_t c = cap, w = wlog;
+            cap = o.cap; wlog = o.wlog;
+            o.cap = c; o.wlog = w;
+            uint8_t tmp[INLINE];
+            memcpy(tmp, buf, INLINE);
+            memcpy(buf, o.buf, INLINE);
+            memcpy(o.buf, tmp, INLINE);
+            return *this;
+        }
+        ~Stack() {
+            if(on_heap()) free(heap);
+        }
+
+        static uint64_t bit(uint32_t slot){
+            return 1ull << (((uint64_t)slot * 0x9E3779B97F4A7C15ull) >> 58);
+        }
+        unsigned width() const {
+            return 1u << wlog;
+        }
+        uint32_t operator[](size_t index) const{
+            if (index >= top) {
+                fprintf(stdout, "Index: %zu, size: %u\n", index, top);
                 throw std::out_of_range("Index of Class Stack out of range");
             }
-            return column[index];
+            return read(index);
         }
-        void push(node_id v){
-            if(top == column.size()){
-                column.emplace_back(v);
-                top++;
-            } else{
-                column[top]= v;
-                top++;
+        void set(size_t index, uint32_t slot){
+            if (index >= top) {
+                fprintf(stdout, "Index: %zu, size: %u\n", index, top);
+                throw std::out_of_range("Index of Class Stack out of range");
             }
-            
+            fit(slot);
+            write(index, slot);
+            filter |= bit(slot);
+        }
+        void push(uint32_t slot){
+            fit(slot);
+            reserve((top + 1) * width());
+            write(top++, slot);
+            filter |= bit(slot);
         }
         void set_top(size_t t){
-            if(t>column.size()){
-                fprintf(stdout, "new top: %zu, size: %zu\n", t, column.size());
+            if(t>top){
+                fprintf(stdout, "new top: %zu, size: %u\n", t, top);
                 throw std::out_of_range("set_top error");
             }
             top = t;
         }
+        // release the heap bytes above top
+        void compact(){
+            size_t need = top * width();
+            if(!on_heap() || need == cap) return;
+            uint8_t *old = heap;
+            if(need <= INLINE){
+                memcpy(buf, old, need);
+                cap = INLINE;
+            } else{
+                heap = (uint8_t *)malloc(need);
+                memcpy(heap, old, need);
+                cap = need;
+            }
+            free(old);
+        }
+        size_t bytes() const {
+            return on_heap() ? cap : 0;
+        }
+        size_t capacity() const {
+            return cap / width();
+        }
+        // set every entry of slot below top to draw(); false (in O(1)
+        // unless the filter gives a false positive) if it is not there
+        template <class F>
+        bool redraw(uint32_t slot, F draw){
+            if(!(filter & bit(slot))) return false;
+            bool found = false;
+            uint64_t f = 0;
+            for(size_t j=0;j<top;j++){
+                uint32_t e = read(j);
+                if(e == slot){
+                    e = draw();
+                    fit(e);
+                    write(j, e);
+                    found = true;
+                }
+                f |= bit(e);
+            }
+            filter = f;
+            return found;
+        }
+        // rename slot from to to below top
+        void replace(uint32_t from, uint32_t to){
+            if(!(filter & bit(from))) return;
+            fit(to);
+            for(size_t j=0;j<top;j++){
+                if(read(j) == from) write(j, to);
+            }
+            filter |= bit(to);
+        }
+        void rebuild_filter(){
+            filter = 0;
+            for(size_t j=0;j<top;j++) filter |= bit(read(j));
+        }
+        // raw entries, top * width() bytes
+        const uint8_t *data() const {
+            return on_heap() ? heap : buf;
+        }
+        void assign(uint32_t t, unsigned w, const uint8_t *raw){
+            top = 0;
+            wlog = w == 4 ? 2 : w == 2 ? 1 : 0;
+            reserve(t * w);
+            memcpy(this->raw(), raw, t * w);
+            top = t;
+            rebuild_filter();
+        }
+
+    private:
+        union {
+            uint8_t buf[INLINE] = {};
+            uint8_t *heap;
+        };
+
+        bool on_heap() const {
+            return cap > INLINE;
+        }
+        uint8_t *raw() {
+            return on_heap() ? heap : buf;
+        }
+        static uint32_t none(unsigned w) {
+            return w == 4 ? UINT32_MAX : (1u << (8 * w)) - 1;
+        }
+        uint32_t read(size_t i) const {
+            unsigned w = width();
+            const uint8_t *p = data() + i * w;
+            uint32_t v = w == 1 ? *p : w == 2 ? *(const uint16_t *)p : *(const uint32_t *)p;
+            return v == none(w) ? NONE : v;
+        }
+        void write(size_t i, uint32_t slot) {
+            unsigned w = width();
+            uint32_t v = slot == NONE ? none(w) : slot;
+            uint8_t *p = raw() + i * w;
+            if(w == 1) *p = v;
+            else if(w == 2) *(uint16_t *)p = v;
+            else *(uint32_t *)p = v;
+        }
+        void reserve(size_t need) {
+            if(need <= cap) return;
+            size_t c = std::max<size_t>(need, 2 * (size_t)cap);
+            uint8_t *h = (uint8_t *)malloc(c);
+            memcpy(h, data(), top * width());
+            if(on_heap()) free(heap);
+            heap = h;
+            cap = c;
+        }
+        // widen the entries until slot fits (NONE always does)
+        void fit(uint32_t slot) {
+            if(slot == NONE || slot < none(width())) return;
+            unsigned to = slot < none(2) ? 2 : 4;
+            std::vector<uint32_t> entries(top);
+            for(size_t j=0;j<top;j++) entries[j] = read(j);
+            if(top * to > cap) reserve(top * to);
+            wlog = to == 4 ? 2 : 1;
+            for(size_t j=0;j<top;j++) write(j, entries[j]);
+        }
     };
 
     class StackTree {
     public:
         std::vector<Stack> _stacktree;
+        // empty with conf->drop_next, see next_of
         std::vector<node_id> next;
-        std::vector<node_id> root;
-        std::vector<double> vol;
-
-        std::vector<node_id> aux_traverse;
-        std::vector<node_id> aux_last;
+        Components components;
 
         StackTree() {}
-        StackTree(node_id num_nodes) : _stacktree(num_nodes,Stack()), next(num_nodes, -1), root(num_nodes, -1), vol(num_nodes, 0), aux_traverse(num_nodes,-1), aux_last(num_nodes,-1){}
+        StackTree(node_id num_nodes) : _stacktree(num_nodes,Stack()) {}
+
+        // bytes held by the tree, heap entries of its stacks included
+        size_t bytes() const {
+            size_t b = _stacktree.capacity() * sizeof(Stack) + next.capacity() * sizeof(node_id) + components.bytes();
+            for(auto &s : _stacktree) b += s.bytes();
+            return b;
+        }
 
         Stack &operator[](size_t index) {
             if (index >= _stacktree.size()) {
@@ -92,12 +415,34 @@ public:
 public:
     Index stack_index;
     size_t num_stacks = 0;
+    // trees whose stacks changed since they were last repaired (lazy_repair only)
+    std::vector<char> dirty;
+    // repairs trees in the background when conf->repair_threads > 0
+    std::unique_ptr<RepairPool> repair_pool;
+    // runs the repairs of in-place updates on conf->num_threads workers
+    std::unique_ptr<WorkerPool> update_pool;
+    // RNG calls spent choosing the trees an insert affects
+    size_t insert_rng_calls = 0;
+    // repair-or-resample choice of in-place updates, see repair_trees
+    RestackCostModel restack_cost;
+    std::vector<size_t> tree_entries;
+    double repair_draws = 0, touched_trees = 0;
+    size_t repair_choices = 0, resample_choices = 0;
+    // column bytes per tree and in total, tracked while
+    // conf->stack_memory_target is set, see track_bytes
+    std::vector<size_t> tree_bytes;
+    std::atomic<size_t> stack_bytes{0};
+    std::atomic<size_t> trimmed_bytes{0};
 
     void show_num_stacks() {
         fprintf(stdout, "num_stacks: %zu\n", num_stacks);
     }
     StackIndex() = default;
-    StackIndex(graph *G, Config *conf, Index stack_index) : IndexMethod<Config>(G, conf), stack_index(stack_index), num_stacks(conf->omega()) {}
+    StackIndex(graph *G, Config *conf, Index stack_index) : IndexMethod<Config>(G, conf), stack_index(stack_index), num_stacks(conf->omega()), dirty(this->stack_index._index.size(), false) {
+        start_repair_pool();
+        count_entries();
+        count_bytes();
+    }
     StackIndex(graph *G, Config *conf) : IndexMethod<Config>(G, conf) {
         conf->show();
 
@@ -105,331 +450,733 @@ public:
         double alpha = conf->alpha;
         if(num_stacks == 0) num_stacks = conf->omega();
         printf("omega: %zu\n", num_stacks);
-        stack_index = Index(num_stacks, G->num_nodes());
         std::vector<bool> intree(G->num_nodes(),false);
         printf("G->n:%d\n",G->num_nodes());
 
+        // every tree is built in place, allocated once; under
+        // conf->build_memory_budget the trees stop before the one expected
+        // (from the average so far) to exceed it, leaving a smaller omega
         Timer tmr(TIMER::BUILD);
+        stack_index._index.reserve(num_stacks);
+        size_t budget = conf->build_memory_budget, built_bytes = 0;
         for (size_t i = 0; i < num_stacks; i++) {
+            if(budget && i && built_bytes + built_bytes / i > budget){
+                log_warn("memory budget %zu reached after %zu of %zu trees", budget, i, num_stacks);
+                break;
+            }
             printf("Building StackTree %zu\n", i);
-            StackTree stacktree(G->num_nodes());
+            auto start = std::chrono::steady_clock::now();
+            StackTree &stacktree = stack_index._index.emplace_back(G->num_nodes());
+            auto &next = next_of(stacktree);
             // stacktree.set_end_geometry(alpha);
             std::fill(intree.begin(),intree.end(),false);
 
             for (node_id u = 0; u < G->num_nodes(); u++) {
                 if(!intree[u]){
                     if(G->is_dangling_node(u)){
-                        stacktree.next[u] = -1;
-                        stacktree.root[u] = u;
-                        stacktree.vol[u] += G->get_degree(u);
-                        stacktree.aux_last[u] = u;
+                        next[u] = -1;
                         intree[u] = true;
                         continue;
                     }
                     node_id current = u;
-                    bool hit_intree = true;
                     while (!intree[current]) {
                         if (rand_uniformf() < alpha) {
-                            hit_intree = false;
-                            stacktree.next[current] = -1;
-                            stacktree[current].push(-1);
-
-                            stacktree.aux_last[current] = current;
+                            next[current] = -1;
+                            stacktree[current].push(Stack::NONE);
                             break;
                         }
-                        stacktree.next[current] = G->get_neighbour(current, rand_uniform(G->get_degree(current)));
-                        stacktree[current].push(stacktree.next[current]);
-                        current = stacktree.next[current];
+                        edge_sno k = rand_uniform(G->get_degree(current));
+                        next[current] = G->get_neighbour(current, k);
+                        stacktree[current].push(k);
+                        current = next[current];
                     }
                     node_id last = current;
-                    node_id r = hit_intree ? stacktree.root[last] : last;
                     current = u;
                     while (current != last) {
-                        stacktree.root[current] = r;
-                        stacktree.vol[r] += G->get_degree(current);
                         intree[current] = true;
+                        current = next[current];
+                    }
+                    intree[last] = true;
+                }
+            }
+            stacktree.components.build(G, next);
+            // every entry of a new tree is a draw, which calibrates the cost
+            // model for resampling before any update
+            size_t draws = 0;
+            for(auto &s : stacktree._stacktree) draws += s.top;
+            restack_cost.add(0, draws, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            telemetry_add(HIST::LOOP_ERASED, record_depths(stacktree));
+            built_bytes += stacktree.bytes();
+        }
+        num_stacks = stack_index._index.size();
+        dirty.assign(num_stacks, false);
+        start_repair_pool();
+        count_entries();
+        count_bytes();
+        printf("StackIndex built, num_stacks: %zu\n", num_stacks);
+    }
 
-                        stacktree.aux_traverse[stacktree.aux_last[r]] = current;
-                        stacktree.aux_last[r] = current;
+    // make the first num trees current, repairing those left dirty by lazy or
+    // background updates, each once for all of its pending changes
+    void repair(size_t num = SIZE_MAX) {
+        std::vector<bool> intree;
+        std::vector<size_t> seen;
+        num = std::min(num, stack_index._index.size());
+        for(size_t i=0;i<num;i++) repair(i, intree, seen);
+    }
 
-                        current = stacktree.next[current];
-                    }
+    void repair(size_t i, std::vector<bool> &intree, std::vector<size_t> &seen) {
+        if(repair_pool) return repair_pool->wait(i, intree, seen);
+        if(!dirty[i]) return;
+        Timer tmr(TIMER::REPAIR);
+        restack(stack_index._index[i], intree, seen);
+        track_bytes(i);
+        dirty[i] = false;
+    }
 
-                    if (!hit_intree) {
-                        stacktree.root[last] = last;
-                        stacktree.vol[r] += G->get_degree(current);
-                        intree[last] = true;
-                    }
+    // Free the next arrays of all trees; from here on they are derived from
+    // the top stack entries whenever an update needs them.
+    void drop_next() {
+        begin_update();
+        conf->drop_next = true;
+        for(auto &stacktree : stack_index._index){
+            stacktree.next.clear();
+            stacktree.next.shrink_to_fit();
+        }
+        end_update();
+    }
 
-                }
+    // Shrink every column to its top and hand the freed memory back to the
+    // system; returns the column bytes released.
+    size_t compact() {
+        begin_update();
+        size_t before = 0, after = 0;
+        for(size_t i=0;i<stack_index._index.size();i++){
+            for(auto &s : stack_index._index[i]._stacktree){
+                before += s.bytes();
+                s.compact();
+                after += s.bytes();
             }
-            stack_index._index[i] = std::move(stacktree);
         }
-        printf("StackIndex built, num_stacks: %zu\n", num_stacks);
+        count_bytes();
+        malloc_trim(0);
+        end_update();
+        return before - after;
+    }
+
+    void begin_update() {
+        if(repair_pool) repair_pool->begin_update();
+    }
+
+    void end_update() {
+        if(repair_pool) repair_pool->end_update();
+    }
+
+
+    // "stacks" holds the Stack objects with their inline entries,
+    // "stacks/entries" counts all entries and the bytes of those on the heap
+    MemoryUsage memory_usage() const {
+        MemoryUsage usage;
+        for(auto &stacktree : stack_index._index){
+            size_t entries = 0, heap = 0;
+            for(auto &s : stacktree._stacktree){
+                entries += s.top;
+                heap += s.bytes();
+            }
+            usage.add("stacks", stacktree._stacktree.capacity() * sizeof(Stack), stacktree._stacktree.size());
+            usage.add("stacks/entries", heap, entries);
+            usage.add("next", stacktree.next.capacity() * sizeof(node_id), stacktree.next.size());
+            stacktree.components.add_usage(usage);
+        }
+        return usage;
     }
 
+    // Trees are sampled independently, so any prefix of them is a valid
+    // index: a query refines over the first conf->omega() trees only, and an
+    // index built at the largest omega serves every smaller one.
+    size_t num_used_stacks() const {
+        return std::min(stack_index._index.size(), std::max<size_t>(1, conf->omega()));
+    }
 
     void refine(ppr_vec &rsv, res_vec &rsd) {
+        size_t num_used = num_used_stacks();
+        repair(num_used);
+        size_t touched = 0, visited = 0;
         for(node_id u=0;u<G->num_nodes();u++){
             if(rsd[u] == 0) continue;
             if(G->is_dangling_node(u)){
                 rsv[u] += rsd[u];
             } else{
-                for(auto &stacktree : stack_index._index){
-                    node_id r = stacktree.root[u];
-                    double vol = stacktree.vol[r];
-                    node_id v = r;
-                    for(;v!=stacktree.aux_last[r];v=stacktree.aux_traverse[v]){
-                        rsv[v] += rsd[u] * G->get_degree(v) / (vol * stack_index._index.size());
-                    }
-                    rsv[v] += rsd[u] * G->get_degree(v) / (vol * stack_index._index.size());
+                touched += num_used;
+                for(size_t i=0;i<num_used;i++){
+                    auto &components = stack_index._index[i].components;
+                    double vol = components.volume(u);
+                    components.for_each(u, [&](node_id v){
+                        rsv[v] += rsd[u] * G->get_degree(v) / (vol * num_used);
+                        visited++;
+                    });
                 }
             }
         }
+        metric_add(COUNTER::REFINE_COMPONENTS, touched);
+        metric_add(COUNTER::REFINE_NODES, visited);
     }
 
-    void update_alpha(double alpha) {
-        printf("StackIndex alpha updated\n");
+    // one tree per sample, for FORA::evaluate_progressive
+    size_t num_samples() const {
+        return num_used_stacks();
     }
 
-    
-    void update_insert(node_id a, node_id b, edge_sno){
-        double alpha = conf->alpha;
-        std::vector<bool> intree(G->num_nodes(),false);
-        std::vector<size_t> seen(G->num_nodes(),0);
-
+    void refine_sample(size_t i, ppr_vec &rsv, const res_vec &rsd) {
+        std::vector<bool> intree;
+        std::vector<size_t> seen;
+        repair(i, intree, seen);
+        auto &stacktree = stack_index._index[i];
+        size_t touched = 0, visited = 0;
+        for(node_id u=0;u<G->num_nodes();u++){
+            if(rsd[u] == 0) continue;
+            if(G->is_dangling_node(u)){
+                rsv[u] += rsd[u];
+                continue;
+            }
+            double vol = stacktree.components.volume(u);
+            stacktree.components.for_each(u, [&](node_id v){
+                rsv[v] += rsd[u] * G->get_degree(v) / vol;
+                visited++;
+            });
+            touched++;
+        }
+        metric_add(COUNTER::REFINE_COMPONENTS, touched);
+        metric_add(COUNTER::REFINE_NODES, visited);
+    }
 
-        for(size_t i =0;i<stack_index._index.size();i++){
-            StackTree &stacktree = stack_index._index[i];
-            Stack &s = stacktree[a];
-            if(s.column.size() == 0) continue;
-            uint32_t first_appear_index = rand_geometric(1.0/G->get_degree(a)) - 1;
-            if(first_appear_index > s.column.size() - 1) continue;
-            s[first_appear_index] = b;
-            s.set_top(first_appear_index+1);
-            std::fill(stacktree.vol.begin(),stacktree.vol.end(),0);
-            std::fill(intree.begin(),intree.end(),false);
-            std::fill(seen.begin(),seen.end(),0);
-            
-            for (node_id u = 0; u < G->num_nodes(); u++) {
-                if(!intree[u]){
-                    if(G->is_dangling_node(u)){
-                        stacktree.next[u] = -1;
-                        stacktree.root[u] = u;
-                        stacktree.vol[u] += G->get_degree(u);
-                        stacktree.aux_last[u] = u;
-                        intree[u] = true;
-                        break;
-                    }
-                    node_id current = u;
-                    bool hit_intree = true;
+    void update_alpha(double alpha) {
+        Timer tmr(TIMER::UPDATE);
 
-                    while (!intree[current]) {
-                        if(seen[current]<stacktree[current].top){
-                            stacktree.next[current] = stacktree[current][seen[current]];
-                            seen[current]++;
-                            if(stacktree.next[current] == -1){
-                                hit_intree = false;
-                                stacktree.aux_last[current] = current;
-                                break;
-                            }
-                        } else{
-                            if (rand_uniformf() < alpha) {
-                                hit_intree = false;
-                                stacktree.next[current] = -1;
-                                stacktree[current].push(-1);
-                                seen[current]++;
-
-                                stacktree.aux_last[current] = current;
-                                break;
-                            }
-                            stacktree.next[current] = G->get_neighbour(current, rand_uniform(G->get_degree(current)));
-                            stacktree[current].push(stacktree.next[current]);
-                            seen[current]++;
-                            current = stacktree.next[current];
-                        }
-                        
-                    }
+        double old_alpha = conf->alpha;
+        if(alpha == old_alpha) return;
+        begin_update();
+        repair();
+        conf->alpha = alpha;
 
-                    node_id last = current;
-                    node_id r = hit_intree ? stacktree.root[last] : last;
-                    current = u;
+        if(alpha > old_alpha){
+            // each move entry turns into a termination with prob q; entries
+            // past the first termination are never read, so they are dropped
+            double q = (alpha - old_alpha) / (1 - old_alpha);
+            std::vector<bool> intree(G->num_nodes(),false);
+            std::vector<size_t> seen(G->num_nodes(),0);
+
+            for(auto &stacktree : stack_index._index){
+                bool changed = false;
+                for(node_id u=0;u<G->num_nodes();u++){
+                    if(G->is_dangling_node(u)) continue;
+                    Stack &s = stacktree[u];
+                    size_t moves = num_moves(s);
+                    size_t j = rand_geometric(q) - 1;
+                    if(j >= moves) continue;
+                    s.set(j, Stack::NONE);
+                    s.set_top(j+1);
+                    changed = true;
+                }
+                if(changed) restack(stacktree, intree, seen);
+            }
+            if(conf->stack_memory_target) count_bytes();
+            end_update();
+            printf("StackIndex updated, num_stacks: %zu\n", num_stacks);
+            return;
+        }
 
-                    while (current != last) {
-                        stacktree.root[current] = r;
-                        stacktree.vol[r] += G->get_degree(current);
-                        intree[current] = true;
+        // alpha decreases: only top entries of roots can change (a termination
+        // turns into a move with prob 1 - alpha / old_alpha), so every forest
+        // is re-rooted incrementally as in StackIndex_Static::update_alpha,
+        // popping cycles by pushing fresh entries onto the stacks
+        double prob = 1 - alpha / old_alpha;
+        uniqueue active_p_queue(G->num_nodes());
+        std::vector<int> status(G->num_nodes(),0);
 
-                        stacktree.aux_traverse[stacktree.aux_last[r]] = current;
-                        stacktree.aux_last[r] = current;
+        for(auto &stacktree : stack_index._index){
+            auto &next = next_of(stacktree, true);
+            active_p_queue.clear();
 
-                        current = stacktree.next[current];
+            for(node_id u=0;u<G->num_nodes();u++){
+                if(G->is_dangling_node(u)){
+                    status[u] = 1;
+                } else if(next[u] == (node_id)-1){
+                    if(rand_uniformf()<prob){
+                        Stack &s = stacktree[u];
+                        active_p_queue.push(u);
+                        edge_sno k = rand_uniform(G->get_degree(u));
+                        next[u] = G->get_neighbour(u, k);
+                        s.set(s.top-1, k);
+                        status[u] = -1;
+                    } else{
+                        status[u] = 1;
                     }
+                } else{
+                    status[u] = 0;
+                }
+            }
 
-                    if (!hit_intree) {
-                        stacktree.root[last] = last;
-                        stacktree.vol[r] += G->get_degree(current);
-                        intree[last] = true;
+            for(node_id u=0;u<G->num_nodes();u++){
+                if(status[stacktree.components.root(u)]==1){
+                    status[u] = 1;
+                }
+            }
 
-                    }
+            while(!active_p_queue.empty()){
+                node_id u = active_p_queue.pop();
+                node_id p = u;
+                while(status[next[p]]==0){
+                    p = next[p];
+                }
 
+                if(status[next[p]]==1){
+                    p = u;
+                    while(status[p]!=1){
+                        status[p] = 1;
+                        p = next[p];
+                    }
+                } else if(next[p]==u){
+                    // pop the cycle through u
+                    p = u;
+                    do{
+                        node_id np = next[p];
+                        if(rand_uniformf()<alpha){
+                            next[p] = -1;
+                            stacktree[p].push(Stack::NONE);
+                            status[p] = 1;
+                        } else{
+                            edge_sno k = rand_uniform(G->get_degree(p));
+                            next[p] = G->get_neighbour(p, k);
+                            stacktree[p].push(k);
+                            status[p] = -1;
+                            active_p_queue.push(p);
+                        }
+                        p = np;
+                    } while(p!=u);
+                } else{
+                    status[u] = 0;
                 }
             }
+            stacktree.components.build(G, next);
         }
+
+        if(conf->stack_memory_target) count_bytes();
+        end_update();
+        printf("StackIndex updated, num_stacks: %zu\n", num_stacks);
+    }
+
+    
+    void update_insert(node_id a, node_id, edge_sno es){
+        std::vector<size_t> trees;
+        edit_insert(a, es, trees);
+        repair_trees(trees);
     }
 
+    void update_delete(node_id a, node_id, edge_sno es){
+        std::vector<size_t> trees;
+        edit_delete(a, es, trees);
+        repair_trees(trees);
+    }
 
+    // Both directions of an undirected edge only change the stacks of its
+    // two endpoints, so they are edited together against the final graph and
+    // every tree touched by either is repaired once.
+    bool fuses_undirected() const {
+        return conf->fuse_undirected;
+    }
 
-    void update_delete(node_id a, node_id b, edge_sno){
-        double alpha = conf->alpha;
-        std::vector<bool> intree(G->num_nodes(),false);
-        std::vector<size_t> seen(G->num_nodes(),0);
+    void update_insert_undirected(node_id u, node_id v, edge_sno uv, edge_sno vu){
+        std::vector<size_t> trees;
+        edit_insert(u, uv, trees);
+        edit_insert(v, vu, trees);
+        repair_trees(trees);
+    }
 
+    void update_delete_undirected(node_id u, node_id v, edge_sno uv, edge_sno vu){
+        std::vector<size_t> trees;
+        edit_delete(u, uv, trees);
+        edit_delete(v, vu, trees);
+        repair_trees(trees);
+    }
 
-        for(size_t i =0;i<stack_index._index.size();i++){
-            StackTree &stacktree = stack_index._index[i];
-            Stack &s = stacktree[a];
-            bool involved = false;
-            for(size_t j=0;j<s.top;j++){
-                if(s[j] == b){
-                    involved = true;
-                    s.set_top(j);
-                    break;
+protected:
+    // The new edge of a sits in slot es. Every move entry of a turns into es
+    // with prob p = 1/deg(a), which leaves the moves uniform over the new
+    // slots, while terminations stay as they are; a tree changes from its
+    // first converted entry. Laid end to end, a's move entries over all
+    // trees form one sequence of Bernoulli(p) trials, so geometric skips
+    // over it land directly on the affected trees and their first positions:
+    // one RNG call per affected tree (plus one), instead of one per tree. If
+    // a was dangling, nothing of its stacks is valid any more and every tree
+    // draws them afresh. The trees changed are appended to trees.
+    void edit_insert(node_id a, edge_sno es, std::vector<size_t> &trees){
+        double p = 1.0/G->get_degree(a);
+        size_t num_trees = stack_index._index.size();
+        std::vector<std::pair<size_t, size_t>> affected;
+        adjust_volumes(a, 1);
+
+        if(G->get_degree(a) == 1){
+            for(size_t i=0;i<num_trees;i++){
+                Stack &s = stack_index._index[i][a];
+                s.set_top(0);
+                s.filter = 0;
+                trees.push_back(i);
+            }
+            return;
+        }
+
+        if(conf->skip_insert_sampling){
+            for(size_t i=0;i<num_trees;i++){
+                uint64_t r = rand_geometric(p) - 1;
+                insert_rng_calls++;
+                for(;i<num_trees;i++){
+                    size_t moves = num_moves(stack_index._index[i][a]);
+                    if(r < moves) break;
+                    r -= moves;
                 }
+                if(i == num_trees) break;
+                affected.emplace_back(i, r);
             }
-            if(!involved) continue;;
-            std::fill(stacktree.vol.begin(),stacktree.vol.end(),0);
-            std::fill(intree.begin(),intree.end(),false);
-            std::fill(seen.begin(),seen.end(),0);
-            
-            for (node_id u = 0; u < G->num_nodes(); u++) {
-                if (G->is_dangling_node(u)) {
-                    stacktree[u].push(-1);
-                } else {
-                    node_id current = u;
-                    bool hit_intree = true;
+        } else{
+            for(size_t i=0;i<num_trees;i++){
+                Stack &s = stack_index._index[i][a];
+                uint32_t first_appear_index = rand_geometric(p) - 1;
+                insert_rng_calls++;
+                if(first_appear_index < num_moves(s)) affected.emplace_back(i, first_appear_index);
+            }
+        }
 
-                    while (!intree[current]) {
-                        if(seen[current]<stacktree[current].top){
-                            stacktree.next[current] = stacktree[current][seen[current]];
-                            seen[current]++;
-                            if(stacktree.next[current] == -1){
-                                hit_intree = false;
-                                stacktree.aux_last[current] = current;
-                                break;
-                            }
-                        } else{
-                            if (rand_uniformf() < alpha) {
-                                hit_intree = false;
-                                stacktree.next[current] = -1;
-                                stacktree[current].push(-1);
-                                seen[current]++;
-
-                                stacktree.aux_last[current] = current;
-                                break;
-                            }
-                            stacktree.next[current] = G->get_neighbour(current, rand_uniform(G->get_degree(current)));
-                            stacktree[current].push(stacktree.next[current]);
-                            seen[current]++;
-                            current = stacktree.next[current];
-                        }
-                        
-                    }
+        for(auto [i, j] : affected){
+            Stack &s = stack_index._index[i][a];
+            s.set(j, es);
+            s.set_top(j+1);
+            trees.push_back(i);
+        }
+    }
 
-                    node_id last = current;
-                    node_id r = hit_intree ? stacktree.root[last] : last;
-                    current = u;
+    // The degree of a changed by delta: every tree's volume follows, also
+    // in the trees the update does not repair.
+    void adjust_volumes(node_id a, int64_t delta){
+        for(auto &stacktree : stack_index._index) stacktree.components.adjust(a, delta);
+    }
 
-                    while (current != last) {
-                        stacktree.root[current] = r;
-                        stacktree.vol[r] += G->get_degree(current);
-                        intree[current] = true;
+    // Entries of s that are moves. A termination ends its walk, so it can
+    // only be the top entry.
+    static size_t num_moves(const Stack &s){
+        return s.top && s[s.top-1] == Stack::NONE ? s.top - 1 : s.top;
+    }
 
-                        stacktree.aux_traverse[stacktree.aux_last[r]] = current;
-                        stacktree.aux_last[r] = current;
+    // The deleted edge left slot es of a, and graph::delete_edge moved a's
+    // last edge (old slot deg(a)) into it. Every entry of es is redrawn as a
+    // move over the deg(a) slots left, which keeps the moves uniform over
+    // them, and its tree changes; the rest of the stack stays. The surviving
+    // entries of the moved edge are then renamed, which leaves the node they
+    // point to and so the tree as it was. If a is left dangling, its stacks
+    // are cleared and every tree a pointed along from changes.
+    void edit_delete(node_id a, edge_sno es, std::vector<size_t> &trees){
+        edge_sno moved = G->get_degree(a);
+        adjust_volumes(a, -1);
+        for(size_t i=0;i<stack_index._index.size();i++){
+            Stack &s = stack_index._index[i][a];
+            if(moved == 0){
+                if(num_moves(s)) trees.push_back(i);
+                s.set_top(0);
+                s.filter = 0;
+                continue;
+            }
+            if(s.redraw(es, [&]{ return (uint32_t)rand_uniform(moved); })) trees.push_back(i);
+            if(moved != es) s.replace(moved, es);
+        }
+    }
 
-                        current = stacktree.next[current];
-                    }
+    // Repair (or mark) each tree in trees once, or resample every tree when
+    // the calibrated cost model expects that to be cheaper: a repair rereads
+    // about a tree's recorded entries and draws a few, a resample draws as
+    // many entries afresh in all trees. Resampling only the trees in trees
+    // would skew the index, since whether an update touches a tree depends
+    // on that tree's stacks. A fresh sample of every tree is right whatever
+    // led to it, and the choice reads only index-wide averages (trees touched
+    // per update, entries and draws per tree) and not which trees this update
+    // touched, so it is made even when it touched none.
+    void repair_trees(std::vector<size_t> &trees){
+        std::sort(trees.begin(), trees.end());
+        trees.erase(std::unique(trees.begin(), trees.end()), trees.end());
+        telemetry_add(HIST::TREES_AFFECTED, trees.size());
+
+        size_t num_trees = stack_index._index.size();
+        double entries = 0;
+        for(size_t e : tree_entries) entries += e;
+        entries /= num_trees;
+        double repair_cost = touched_trees * restack_cost.predict(std::max(0.0, entries - repair_draws), repair_draws);
+        double resample_cost = num_trees * restack_cost.predict(0, entries);
+        bool resample = restack_cost.calibrated() && resample_cost < repair_cost;
+        (resample ? resample_choices : repair_choices)++;
+        touched_trees += 0.1 * (trees.size() - touched_trees);
+        log_debug("%zu tree(s) touched, %s, estimated %.3g s (repair %.3g, resample all %.3g)",
+            trees.size(), resample ? "resample all" : "repair", resample ? resample_cost : repair_cost, repair_cost, resample_cost);
+
+        if(resample){
+            trees.resize(num_trees);
+            std::iota(trees.begin(), trees.end(), 0);
+            for(size_t i : trees) clear_stacks(stack_index._index[i]);
+        }
+        if(trees.empty()) return;
+        if(repair_pool || conf->lazy_repair){
+            for(size_t i : trees) mark_dirty(i);
+            return;
+        }
 
-                    if (!hit_intree) {
-                        stacktree.root[last] = last;
-                        stacktree.vol[r] += G->get_degree(current);
-                        intree[last] = true;
+        WorkerPool &pool = worker_pool(update_pool, update_workers());
+        std::vector<std::vector<bool>> intrees(pool.size());
+        std::vector<std::vector<size_t>> seens(pool.size());
+        std::vector<RestackCount> counts(trees.size());
+        // time of each tree restacked by worker 0, the calling thread, or -1
+        std::vector<double> times(trees.size(), -1);
+
+        pool.run(trees.size(), [&](size_t k, size_t w){
+            auto start = std::chrono::steady_clock::now();
+            counts[k] = restack(stack_index._index[trees[k]], intrees[w], seens[w]);
+            if(w == 0) times[k] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            track_bytes(trees[k]);
+        });
+
+        // the model is fitted on the calling thread only, as the build's
+        // samples were: both costs it weighs are per-tree times, and those
+        // of other workers would mix in how they were scheduled
+        for(size_t k=0;k<trees.size();k++){
+            if(times[k] >= 0) restack_cost.add(counts[k].reads, counts[k].draws, times[k]);
+            tree_entries[trees[k]] = counts[k].reads + counts[k].draws;
+            if(!resample) repair_draws += 0.1 * (counts[k].draws - repair_draws);
+        }
+    }
 
-                    }
+    // Trees are repaired independently, so an update spreads its trees over
+    // conf->num_threads workers (with their own scratch space and RNG); a
+    // lazy or background update only touches stacks and stays serial.
+    size_t update_workers() const {
+        if(repair_pool || conf->lazy_repair) return 1;
+        return std::max<size_t>(1, std::min(conf->num_threads, stack_index._index.size()));
+    }
 
-                }
+    // tree i changed under a lazy or background update
+    void mark_dirty(size_t i) {
+        if(repair_pool) return repair_pool->mark(i);
+        dirty[i] = true;
+    }
+
+    // The next array of a tree, or with conf->drop_next a per-thread scratch
+    // one; derive fills it from the top stack entries, which are what every
+    // node points along once its tree is repaired.
+    std::vector<node_id> &next_of(StackTree &stacktree, bool derive = false) {
+        static thread_local std::vector<node_id> scratch;
+        auto &next = conf->drop_next ? scratch : stacktree.next;
+        next.resize(G->num_nodes(), -1);
+        if(conf->drop_next && derive){
+            for(node_id u=0;u<G->num_nodes();u++){
+                const Stack &s = stacktree[u];
+                uint32_t k = s.top ? s[s.top-1] : Stack::NONE;
+                next[u] = k == Stack::NONE || G->is_dangling_node(u) ? -1 : G->get_neighbour(u, k);
             }
         }
+        return next;
     }
-    
-};
 
+    void clear_stacks(StackTree &stacktree) {
+        for(node_id u=0;u<G->num_nodes();u++){
+            stacktree[u].set_top(0);
+            stacktree[u].filter = 0;
+        }
+    }
 
-class StackIndex_Realtime : public StackIndex {
-public:
-    StackIndex_Realtime(graph *G, Config *conf):StackIndex(G,conf){}
+    // Called for every tree after it was restacked, on whichever thread did
+    // it. While the columns are over conf->stack_memory_target, those holding
+    // more than twice their live entries are shrunk, so an update stream
+    // compacts the index incrementally (in the background with a repair
+    // pool) without a separate pass.
+    void track_bytes(size_t i) {
+        size_t target = conf->stack_memory_target;
+        if(target == 0) return;
+        bool over = stack_bytes.load(std::memory_order_relaxed) > target;
+        size_t bytes = 0, freed = 0;
+        for(auto &s : stack_index._index[i]._stacktree){
+            if(over && s.capacity() > 2 * s.top + 4){
+                freed += s.bytes();
+                s.compact();
+                freed -= s.bytes();
+            }
+            bytes += s.bytes();
+        }
+        stack_bytes += bytes;
+        stack_bytes -= tree_bytes[i];
+        tree_bytes[i] = bytes;
+        // freed columns are small blocks that stay with malloc until trimmed
+        if(freed && trimmed_bytes.fetch_add(freed) + freed > target / 16){
+            trimmed_bytes = 0;
+            malloc_trim(0);
+        }
+    }
 
-    void update_insert(node_id a, node_id b, edge_sno){
+    void count_bytes() {
+        tree_bytes.assign(stack_index._index.size(), 0);
+        size_t total = 0;
+        for(size_t i=0;i<stack_index._index.size();i++){
+            for(auto &s : stack_index._index[i]._stacktree) tree_bytes[i] += s.bytes();
+            total += tree_bytes[i];
+        }
+        stack_bytes = total;
+    }
 
-        double alpha = conf->alpha;
-        stack_index = Index(num_stacks, G->num_nodes());
-        std::vector<bool> intree(G->num_nodes(),false);
+    void count_entries() {
+        tree_entries.assign(stack_index._index.size(), 0);
+        for(size_t i=0;i<stack_index._index.size();i++){
+            for(node_id u=0;u<G->num_nodes();u++) tree_entries[i] += stack_index._index[i][u].top;
+        }
+    }
 
-        Timer tmr(TIMER::BUILD);
-        for (size_t i = 0; i < num_stacks; i++) {
-            StackTree stacktree(G->num_nodes());
+    void start_repair_pool() {
+        if(conf->repair_threads == 0) return;
+        repair_pool = std::make_unique<RepairPool>(stack_index._index.size(), conf->repair_threads,
+            [this](size_t i, std::vector<bool> &intree, std::vector<size_t> &seen){
+                restack(stack_index._index[i], intree, seen);
+                track_bytes(i);
+            });
+    }
+
+    struct RestackCount {
+        size_t reads = 0, draws = 0;
+    };
+
+    // Rebuild stacktree by cycle popping over the recorded stacks: entries
+    // below top are read first and fresh ones are drawn (and pushed) only
+    // once a stack runs out. Unread entries are dropped afterwards, so every
+    // stack ends exactly at the entry its node points along. intree and seen
+    // are scratch space, sized on first use.
+    RestackCount restack(StackTree &stacktree, std::vector<bool> &intree, std::vector<size_t> &seen) {
+        TraceSpan span("restack", "repair");
+        RestackCount count;
+        double alpha = conf->alpha;
+        auto &next = next_of(stacktree);
+        intree.assign(G->num_nodes(),false);
+        seen.assign(G->num_nodes(),0);
+
+        for (node_id u = 0; u < G->num_nodes(); u++) {
+            if(!intree[u]){
+                node_id current = u;
+
+                while (!intree[current]) {
+                    if(G->is_dangling_node(current)){
+                        next[current] = -1;
+                        break;
+                    }
+                    if(seen[current]<stacktree[current].top){
+                        uint32_t k = stacktree[current][seen[current]];
+                        next[current] = k == Stack::NONE ? -1 : G->get_neighbour(current, k);
+                        seen[current]++;
+                        count.reads++;
+                    } else if (rand_uniformf() < alpha) {
+                        next[current] = -1;
+                        stacktree[current].push(Stack::NONE);
+                        seen[current]++;
+                        count.draws++;
+                    } else{
+                        edge_sno k = rand_uniform(G->get_degree(current));
+                        next[current] = G->get_neighbour(current, k);
+                        stacktree[current].push(k);
+                        seen[current]++;
+                        count.draws++;
+                    }
+                    if(next[current] == (node_id)-1) break;
+                    current = next[current];
+                }
+
+                node_id last = current;
+                current = u;
+                while (current != last) {
+                    intree[current] = true;
+                    current = next[current];
+                }
+                intree[last] = true;
+            }
+        }
+        stacktree.components.build(G, next);
+
+        for (node_id u = 0; u < G->num_nodes(); u++) {
+            if(!G->is_dangling_node(u)) stacktree[u].set_top(seen[u]);
+        }
+        telemetry_add(HIST::LOOP_ERASED, record_depths(stacktree));
+        telemetry_add(HIST::REWALKED_STEPS, count.reads + count.draws);
+        telemetry_add(HIST::REWALKED_DRAWS, count.draws);
+        span.arg("tree", &stacktree - stack_index._index.data());
+        span.arg("reads", count.reads);
+        span.arg("draws", count.draws);
+        return count;
+    }
+
+    // Record the stack depth of every node of a tree just built or
+    // restacked, see time/telemetry.hpp; returns the walk steps erased by
+    // loops, i.e. the entries below the tops.
+    size_t record_depths(StackTree &stacktree) {
+        size_t erased = 0;
+        for(node_id u=0;u<G->num_nodes();u++){
+            if(G->is_dangling_node(u)) continue;
+            uint32_t top = stacktree[u].top;
+            telemetry_depth(G->get_degree(u), top);
+            erased += top - 1;
+        }
+        return erased;
+    }
+};
+
+
+class StackIndex_Realtime : public StackIndex {
+public:
+    StackIndex_Realtime(graph *G, Config *conf):StackIndex(G,conf){}
+    bool fuses_undirected() const { return false; }
+
+    void update_insert(node_id, node_id, edge_sno){
+
+        double alpha = conf->alpha;
+        stack_index._index.clear();
+        stack_index._index.reserve(num_stacks);
+        std::vector<bool> intree(G->num_nodes(),false);
+
+        Timer tmr(TIMER::BUILD);
+        for (size_t i = 0; i < num_stacks; i++) {
+            StackTree &stacktree = stack_index._index.emplace_back(G->num_nodes());
+            auto &next = next_of(stacktree);
             // stacktree.set_end_geometry(alpha);
             std::fill(intree.begin(),intree.end(),false);
 
             for (node_id u = 0; u < G->num_nodes(); u++) {
                 if(!intree[u]){
                     if(G->is_dangling_node(u)){
-                        stacktree.next[u] = -1;
-                        stacktree.root[u] = u;
-                        stacktree.vol[u] += G->get_degree(u);
-                        stacktree.aux_last[u] = u;
+                        next[u] = -1;
                         intree[u] = true;
                         continue;
                     }
                     node_id current = u;
-                    bool hit_intree = true;
                     while (!intree[current]) {
                         if (rand_uniformf() < alpha || G->is_dangling_node(current)) {
-                            hit_intree = false;
-                            stacktree.next[current] = -1;
-                            stacktree[current].push(-1);
-
-                            stacktree.aux_last[current] = current;
+                            next[current] = -1;
+                            stacktree[current].push(Stack::NONE);
                             break;
                         }
-                        stacktree.next[current] = G->get_neighbour(current, rand_uniform(G->get_degree(current)));
-                        stacktree[current].push(stacktree.next[current]);
-                        current = stacktree.next[current];
+                        edge_sno k = rand_uniform(G->get_degree(current));
+                        next[current] = G->get_neighbour(current, k);
+                        stacktree[current].push(k);
+                        current = next[current];
                     }
                     node_id last = current;
-                    node_id r = hit_intree ? stacktree.root[last] : last;
                     current = u;
                     while (current != last) {
-                        stacktree.root[current] = r;
-                        stacktree.vol[r] += G->get_degree(current);
                         intree[current] = true;
-
-                        stacktree.aux_traverse[stacktree.aux_last[r]] = current;
-                        stacktree.aux_last[r] = current;
-
-                        current = stacktree.next[current];
-                    }
-
-                    if (!hit_intree) {
-                        stacktree.root[last] = last;
-                        stacktree.vol[r] += G->get_degree(current);
-                        intree[last] = true;
+                        current = next[current];
                     }
-
+                    intree[last] = true;
                 }
             }
-            stack_index._index[i] = std::move(stacktree);
+            stacktree.components.build(G, next);
         }
     }  
 
@@ -446,14 +1193,14 @@ public:
     class StackTree {
     public:
         std::vector<node_id> next;
-        std::vector<node_id> root;
-        std::vector<double> vol;
-
-        std::vector<node_id> aux_traverse;
-        std::vector<node_id> aux_last;
+        Components components;
 
         StackTree() {}
-        StackTree(node_id num_nodes) :  next(num_nodes, -1), root(num_nodes, -1), vol(num_nodes, 0), aux_traverse(num_nodes,-1), aux_last(num_nodes,-1){}
+        StackTree(node_id num_nodes) :  next(num_nodes, -1) {}
+
+        size_t bytes() const {
+            return next.capacity() * sizeof(node_id) + components.bytes();
+        }
     };
 
     class Index {
@@ -473,6 +1220,8 @@ public:
 public:
     Index stack_index;
     size_t num_stacks = 0;
+    // re-roots the trees of update_alpha on conf->num_threads workers
+    std::unique_ptr<WorkerPool> update_pool;
 
     void show_num_stacks() {
         fprintf(stdout, "num_stacks: %zu\n", num_stacks);
@@ -486,13 +1235,19 @@ public:
         double alpha = conf->alpha;
         if(num_stacks == 0) num_stacks = conf->omega();
         printf("omega: %zu\n", num_stacks);
-        stack_index = Index(num_stacks, G->num_nodes());
         std::vector<bool> intree(G->num_nodes(),false);
 
+        // built in place under conf->build_memory_budget, see StackIndex
         Timer tmr(TIMER::BUILD);
+        stack_index._index.reserve(num_stacks);
+        size_t budget = conf->build_memory_budget, built_bytes = 0;
         for (size_t i = 0; i < num_stacks; i++) {
+            if(budget && i && built_bytes + built_bytes / i > budget){
+                log_warn("memory budget %zu reached after %zu of %zu trees", budget, i, num_stacks);
+                break;
+            }
             printf("Building StackTree %zu\n", i);
-            StackTree stacktree(G->num_nodes());
+            StackTree &stacktree = stack_index._index.emplace_back(G->num_nodes());
             // stacktree.set_end_geometry(alpha);
             std::fill(intree.begin(),intree.end(),false);
 
@@ -500,21 +1255,14 @@ public:
                 if(!intree[u]){
                     if(G->is_dangling_node(u)){
                         stacktree.next[u] = -1;
-                        stacktree.root[u] = u;
-                        stacktree.vol[u] += G->get_degree(u);
-                        stacktree.aux_last[u] = u;
                         intree[u] = true;
                         continue;
                     }
                     node_id current = u;
-                    bool hit_intree = true;
 
                     while (!intree[current]) {
                         if (rand_uniformf() < alpha) {
-                            hit_intree = false;
                             stacktree.next[current] = -1;
-
-                            stacktree.aux_last[current] = current;
                             break;
                         }
                         stacktree.next[current] = G->get_neighbour(current, rand_uniform(G->get_degree(current)));
@@ -522,53 +1270,82 @@ public:
                     }
 
                     node_id last = current;
-                    node_id r = hit_intree ? stacktree.root[last] : last;
                     current = u;
 
                     while (current != last) {
-                        stacktree.root[current] = r;
-                        stacktree.vol[r] += G->get_degree(current);
                         intree[current] = true;
-
-                        stacktree.aux_traverse[stacktree.aux_last[r]] = current;
-                        stacktree.aux_last[r] = current;
-
                         current = stacktree.next[current];
                     }
-
-                    if (!hit_intree) {
-                        stacktree.root[last] = last;
-                        stacktree.vol[r] += G->get_degree(current);
-                        intree[last] = true;
-
-                    }
+                    intree[last] = true;
                 }
-                
-
             }
-            stack_index._index[i] = std::move(stacktree);
+            stacktree.components.build(G, stacktree.next);
+            built_bytes += stacktree.bytes();
         }
+        num_stacks = stack_index._index.size();
         printf("StackIndex built, num_stacks: %zu\n", num_stacks);
     }
 
 
+    MemoryUsage memory_usage() const {
+        MemoryUsage usage;
+        for(auto &stacktree : stack_index._index){
+            usage.add("next", stacktree.next.capacity() * sizeof(node_id), stacktree.next.size());
+            stacktree.components.add_usage(usage);
+        }
+        return usage;
+    }
+
+    // see StackIndex::num_used_stacks
+    size_t num_used_stacks() const {
+        return std::min(stack_index._index.size(), std::max<size_t>(1, conf->omega()));
+    }
+
     void refine(ppr_vec &rsv, res_vec &rsd) {
+        size_t num_used = num_used_stacks();
+        size_t touched = 0, visited = 0;
         for(node_id u=0;u<G->num_nodes();u++){
             if(rsd[u] == 0) continue;
             if(G->is_dangling_node(u)){
                 rsv[u] += rsd[u];
             } else{
-                for(auto &stacktree : stack_index._index){
-                    node_id r = stacktree.root[u];
-                    double vol = stacktree.vol[r];
-                    node_id v = r;
-                    for(;v!=stacktree.aux_last[r];v=stacktree.aux_traverse[v]){
-                        rsv[v] += rsd[u] * G->get_degree(v) / (vol * stack_index._index.size());
-                    }
-                    rsv[v] += rsd[u] * G->get_degree(v) / (vol * stack_index._index.size());
+                touched += num_used;
+                for(size_t i=0;i<num_used;i++){
+                    auto &components = stack_index._index[i].components;
+                    double vol = components.volume(u);
+                    components.for_each(u, [&](node_id v){
+                        rsv[v] += rsd[u] * G->get_degree(v) / (vol * num_used);
+                        visited++;
+                    });
                 }
             }
         }
+        metric_add(COUNTER::REFINE_COMPONENTS, touched);
+        metric_add(COUNTER::REFINE_NODES, visited);
+    }
+
+    size_t num_samples() const {
+        return num_used_stacks();
+    }
+
+    void refine_sample(size_t i, ppr_vec &rsv, const res_vec &rsd) {
+        auto &stacktree = stack_index._index[i];
+        size_t touched = 0, visited = 0;
+        for(node_id u=0;u<G->num_nodes();u++){
+            if(rsd[u] == 0) continue;
+            if(G->is_dangling_node(u)){
+                rsv[u] += rsd[u];
+                continue;
+            }
+            double vol = stacktree.components.volume(u);
+            stacktree.components.for_each(u, [&](node_id v){
+                rsv[v] += rsd[u] * G->get_degree(v) / vol;
+                visited++;
+            });
+            touched++;
+        }
+        metric_add(COUNTER::REFINE_COMPONENTS, touched);
+        metric_add(COUNTER::REFINE_NODES, visited);
     }
 
     void update_alpha(double alpha) {
@@ -579,124 +1356,664 @@ public:
         double prob = 1 - alpha / old_alpha;
         printf("prob: %lf\n", prob);
 
-        uniqueue active_p_queue(G->num_nodes());
-        std::vector<int> status(G->num_nodes(),0);
+        // trees are re-rooted independently, each worker on its own queue and status
+        WorkerPool &pool = worker_pool(update_pool, std::min(conf->num_threads, stack_index._index.size()));
+        std::vector<uniqueue> active_p_queues(pool.size(), uniqueue(G->num_nodes()));
+        std::vector<std::vector<int>> statuses(pool.size(), std::vector<int>(G->num_nodes(),0));
 
-        for(auto & stacktree : stack_index._index){
-            // printf("StackIndex updating\n");
-            active_p_queue.clear();
-            
-            for(node_id u=0;u<G->num_nodes();u++){
-                if(stacktree.next[u]==-1 && !G->is_dangling_node(u)){
-                    if(rand_uniformf()<prob){
-                        // outtree选出的root的子树
-                        active_p_queue.push(u);
-                        stacktree.next[u] = G->get_neighbour(u, rand_uniform(G->get_degree(u)));
-                        status[u] = -1;
-                    } else{
-                        status[u] = 1;
-                    }
-                } else{
-                    status[u] = 0;
-                }
-            }
+        pool.run(stack_index._index.size(), [&](size_t i, size_t w){
+            update_alpha(stack_index._index[i], alpha, prob, active_p_queues[w], statuses[w]);
+        });
 
-            for(node_id u=0;u<G->num_nodes();u++){
-                if(status[stacktree.root[u]]==1){
+        printf("StackIndex updated, num_stacks: %zu\n", num_stacks);
+    }
+
+    // Trees are not repaired after edge updates, but their volumes follow
+    // the degrees, so the estimates still sum to one.
+    void update_insert(node_id a, node_id, edge_sno){
+        for(auto &stacktree : stack_index._index) stacktree.components.adjust(a, 1);
+    }
+
+    void update_delete(node_id a, node_id, edge_sno){
+        for(auto &stacktree : stack_index._index) stacktree.components.adjust(a, -1);
+    }
+
+private:
+    void update_alpha(StackTree &stacktree, double alpha, double prob, uniqueue &active_p_queue, std::vector<int> &status) {
+        active_p_queue.clear();
+
+        for(node_id u=0;u<G->num_nodes();u++){
+            if(G->is_dangling_node(u)){
+                status[u] = 1;
+            } else if(stacktree.next[u] == (node_id)-1){
+                if(rand_uniformf()<prob){
+                    // outtree选出的root的子树
+                    active_p_queue.push(u);
+                    stacktree.next[u] = G->get_neighbour(u, rand_uniform(G->get_degree(u)));
+                    status[u] = -1;
+                } else{
                     status[u] = 1;
                 }
+            } else{
+                status[u] = 0;
             }
+        }
 
-            // 从active_p_queue中取出一个p处理：
-            while(!active_p_queue.empty()){
-                node_id u = active_p_queue.pop();
-                node_id p = u;
-                while(status[stacktree.next[p]]==0){
-                    p = stacktree.next[p];
-                }
-
-                if(status[stacktree.next[p]]==1){
-                    node_id r = stacktree.root[stacktree.next[p]];       
-                    p = u;
-                    while(status[stacktree.next[p]]!=1){
-                        status[p] = 1;
-                        stacktree.root[p] = r;
-                        stacktree.vol[r] += G->get_degree(p);
+        for(node_id u=0;u<G->num_nodes();u++){
+            if(status[stacktree.components.root(u)]==1){
+                status[u] = 1;
+            }
+        }
 
-                        stacktree.aux_traverse[stacktree.aux_last[r]] = p;
-                        stacktree.aux_last[r] = p;
+        // 从active_p_queue中取出一个p处理：
+        while(!active_p_queue.empty()){
+            node_id u = active_p_queue.pop();
+            node_id p = u;
+            while(status[stacktree.next[p]]==0){
+                p = stacktree.next[p];
+            }
 
-                        p = stacktree.next[p];
-                        
-                    }
+            if(status[stacktree.next[p]]==1){
+                p = u;
+                while(status[stacktree.next[p]]!=1){
                     status[p] = 1;
-                    stacktree.root[p] = r;
-                    stacktree.vol[r] += G->get_degree(p);
-
-                    stacktree.aux_traverse[stacktree.aux_last[r]] = p;
-                    stacktree.aux_last[r] = p;
-
-                } else if(stacktree.next[p]==u){    
-                    p = u;
-                    while(stacktree.next[p]!=u){
-                        node_id np = stacktree.next[p];
-                        if(rand_uniformf()<alpha){
-                            stacktree.next[p] = -1;
-                            status[p] = 1;
-                            stacktree.root[p] = p;
-                            stacktree.vol[p] += G->get_degree(p);
+                    p = stacktree.next[p];
+                }
+                status[p] = 1;
 
-                            stacktree.aux_last[p] = p;
-                        } else{
-                            stacktree.next[p] = G->get_neighbour(p, rand_uniform(G->get_degree(p)));
-                            status[p] = -1;
-                            active_p_queue.push(p);
-                        }
-                        p = np;
-                    }
+            } else if(stacktree.next[p]==u){
+                p = u;
+                while(stacktree.next[p]!=u){
+                    node_id np = stacktree.next[p];
                     if(rand_uniformf()<alpha){
                         stacktree.next[p] = -1;
                         status[p] = 1;
-                        stacktree.root[p] = p;
-                        stacktree.vol[p] += G->get_degree(p);
-
-                        stacktree.aux_last[p] = p;
                     } else{
                         stacktree.next[p] = G->get_neighbour(p, rand_uniform(G->get_degree(p)));
                         status[p] = -1;
                         active_p_queue.push(p);
                     }
+                    p = np;
+                }
+                if(rand_uniformf()<alpha){
+                    stacktree.next[p] = -1;
+                    status[p] = 1;
                 } else{
-                    status[u] = 0;
+                    stacktree.next[p] = G->get_neighbour(p, rand_uniform(G->get_degree(p)));
+                    status[p] = -1;
+                    active_p_queue.push(p);
                 }
-                
+            } else{
+                status[u] = 0;
+            }
+
 
+        }
+
+        stacktree.components.build(G, stacktree.next);
+    }
+};
+
+
+// One set of stacks serving several alphas. Every stack entry names a
+// neighbour and carries a termination mark: under alpha the entry terminates
+// iff mark < alpha * 2^32, otherwise it moves to the neighbour. The marks are
+// shared, so termination decisions are coupled across alphas, and each alpha
+// keeps its own Components over the common stacks.
+class StackIndex_MultiAlpha : public IndexMethod<Config> {
+public:
+    struct Entry {
+        node_id v;
+        uint32_t mark;
+    };
+
+    class StackTree {
+    public:
+        std::vector<std::vector<Entry>> _stacktree;
+        // the forest of each served alpha
+        std::vector<Components> components;
+
+        StackTree() {}
+        StackTree(node_id num_nodes, size_t num_alphas) : _stacktree(num_nodes), components(num_alphas) {}
+    };
+
+    // scratch space of restack
+    class Workspace {
+    public:
+        std::vector<bool> intree;
+        std::vector<size_t> seen;
+        std::vector<size_t> used;
+        std::vector<node_id> next;
+
+        Workspace(node_id num_nodes) : intree(num_nodes,false), seen(num_nodes,0), used(num_nodes,0), next(num_nodes,-1) {}
+    };
+
+public:
+    std::vector<double> alphas;
+    std::vector<StackTree> stack_index;
+    size_t num_stacks = 0;
+
+    StackIndex_MultiAlpha(graph *G, Config *conf, std::vector<double> alphas) : IndexMethod<Config>(G, conf), alphas(alphas) {
+        conf->show();
+
+        printf("Building StackIndex_MultiAlpha over %zu alphas\n", alphas.size());
+        if(num_stacks == 0) num_stacks = conf->omega();
+        printf("omega: %zu\n", num_stacks);
+        Workspace ws(G->num_nodes());
+
+        Timer tmr(TIMER::BUILD);
+        stack_index.reserve(num_stacks);
+        for (size_t i = 0; i < num_stacks; i++) {
+            stack_index.emplace_back(G->num_nodes(), alphas.size());
+            restack(stack_index.back(), ws);
+        }
+        printf("StackIndex_MultiAlpha built, num_stacks: %zu\n", num_stacks);
+    }
+
+    // index of alpha among the served ones
+    size_t alpha_sno(double alpha) const {
+        for (size_t k = 0; k < alphas.size(); k++) {
+            if (std::abs(alphas[k] - alpha) < 1e-9) return k;
+        }
+        fprintf(stdout, "alpha: %lf\n", alpha);
+        throw std::out_of_range("alpha is not served by StackIndex_MultiAlpha");
+    }
+
+    bool serves_alpha(double alpha) const {
+        for (double a : alphas) {
+            if (std::abs(a - alpha) < 1e-9) return true;
+        }
+        return false;
+    }
+
+    MemoryUsage memory_usage() const {
+        MemoryUsage usage;
+        for(auto &stacktree : stack_index){
+            size_t entries = 0, heap = 0;
+            for(auto &s : stacktree._stacktree){
+                entries += s.size();
+                heap += s.capacity() * sizeof(Entry);
             }
+            usage.add("stacks", stacktree._stacktree.capacity() * sizeof(std::vector<Entry>), stacktree._stacktree.size());
+            usage.add("stacks/entries", heap, entries);
+            for(auto &components : stacktree.components) components.add_usage(usage);
+        }
+        return usage;
+    }
 
-            for(node_id u=0;u<G->num_nodes();u++){
-                if(status[u]==0){
-                    node_id p = u;
-                    while(status[p]==0){
-                        p = stacktree.next[p];
-                    }
-                    node_id r = stacktree.root[p];
-                    p = u;
-                    while(status[p]==0){
-                        status[p] = 1;
-                        stacktree.root[p] = r;
-                        stacktree.vol[r] += G->get_degree(p);
+    // see StackIndex::num_used_stacks
+    size_t num_used_stacks() const {
+        return std::min(stack_index.size(), std::max<size_t>(1, conf->omega()));
+    }
+
+    void refine(ppr_vec &rsv, res_vec &rsd) {
+        refine(rsv, rsd, conf->alpha);
+    }
+
+    void refine(ppr_vec &rsv, res_vec &rsd, double alpha) {
+        size_t k = alpha_sno(alpha);
+        size_t num_used = num_used_stacks();
+        size_t touched = 0, visited = 0;
+        for(node_id u=0;u<G->num_nodes();u++){
+            if(rsd[u] == 0) continue;
+            if(G->is_dangling_node(u)){
+                rsv[u] += rsd[u];
+            } else{
+                touched += num_used;
+                for(size_t i=0;i<num_used;i++){
+                    auto &components = stack_index[i].components[k];
+                    double vol = components.volume(u);
+                    components.for_each(u, [&](node_id v){
+                        rsv[v] += rsd[u] * G->get_degree(v) / (vol * num_used);
+                        visited++;
+                    });
+                }
+            }
+        }
+        metric_add(COUNTER::REFINE_COMPONENTS, touched);
+        metric_add(COUNTER::REFINE_NODES, visited);
+    }
+
+    // the served alphas are fixed at build, only the default one can change
+    void update_alpha(double alpha) {
+        alpha_sno(alpha);
+        conf->alpha = alpha;
+    }
+
+    void update_insert(node_id a, node_id b, edge_sno){
+        adjust_volumes(a, 1);
+        Workspace ws(G->num_nodes());
+        for(auto &stacktree : stack_index){
+            auto &s = stacktree._stacktree[a];
+            if(s.empty()) continue;
+            uint32_t first_appear_index = rand_geometric(1.0/G->get_degree(a)) - 1;
+            if(first_appear_index >= s.size()) continue;
+            s[first_appear_index].v = b;
+            s.resize(first_appear_index+1);
+            restack(stacktree, ws);
+        }
+    }
+
+    void update_delete(node_id a, node_id b, edge_sno){
+        adjust_volumes(a, -1);
+        Workspace ws(G->num_nodes());
+        for(auto &stacktree : stack_index){
+            auto &s = stacktree._stacktree[a];
+            auto it = std::find_if(s.begin(), s.end(), [b](const Entry &e){ return e.v == b; });
+            if(it == s.end()) continue;
+            s.erase(it, s.end());
+            restack(stacktree, ws);
+        }
+    }
+
+private:
+    // see StackIndex::adjust_volumes
+    void adjust_volumes(node_id a, int64_t delta) {
+        for(auto &stacktree : stack_index){
+            for(auto &components : stacktree.components) components.adjust(a, delta);
+        }
+    }
+
+    static uint32_t mark_cut(double alpha) {
+        return (uint32_t)std::min(alpha * 0x1.0p32, 4294967295.);
+    }
 
-                        stacktree.aux_traverse[stacktree.aux_last[r]] = p;
-                        stacktree.aux_last[r] = p;
+    // Rebuild the forest of every alpha by cycle popping over the shared
+    // stacks, drawing new entries once a stack runs out. Entries no alpha
+    // reads are dropped afterwards.
+    void restack(StackTree &stacktree, Workspace &ws) {
+        std::fill(ws.used.begin(),ws.used.end(),0);
 
-                        p = stacktree.next[p];
+        for (size_t k = 0; k < alphas.size(); k++) {
+            uint32_t cut = mark_cut(alphas[k]);
+            std::fill(ws.intree.begin(),ws.intree.end(),false);
+            std::fill(ws.seen.begin(),ws.seen.end(),0);
+
+            for (node_id u = 0; u < G->num_nodes(); u++) {
+                if(ws.intree[u]) continue;
+                node_id current = u;
+
+                while (!ws.intree[current]) {
+                    if(G->is_dangling_node(current)){
+                        ws.next[current] = -1;
+                        break;
+                    }
+                    auto &s = stacktree._stacktree[current];
+                    if(ws.seen[current] == s.size()){
+                        s.push_back({G->get_neighbour(current, rand_uniform(G->get_degree(current))), (uint32_t)rand_uint()});
                     }
+                    const Entry &e = s[ws.seen[current]++];
+                    if(e.mark < cut){
+                        ws.next[current] = -1;
+                        break;
+                    }
+                    ws.next[current] = e.v;
+                    current = e.v;
                 }
+
+                node_id last = current;
+                current = u;
+                while (current != last) {
+                    ws.intree[current] = true;
+                    current = ws.next[current];
+                }
+                ws.intree[last] = true;
+            }
+            stacktree.components[k].build(G, ws.next);
+
+            for (node_id u = 0; u < G->num_nodes(); u++) {
+                ws.used[u] = std::max(ws.used[u], ws.seen[u]);
             }
-            
         }
-            
-        printf("StackIndex updated, num_stacks: %zu\n", num_stacks);
+
+        for (node_id u = 0; u < G->num_nodes(); u++) {
+            stacktree._stacktree[u].resize(ws.used[u]);
+        }
     }
 };
 
+
+// StackIndex without stored stacks: entry i of node u in tree t is
+// regenerated on demand from a counter-based draw keyed by (t, u, epoch of
+// u, i), which terminates below the alpha cut and otherwise picks a
+// neighbour. A node's epoch moves on whenever its adjacency changes; the
+// entries its trees had consumed by then were drawn over the old adjacency,
+// so they are kept as explicit overrides, as are the entries updates write.
+// Updates follow StackIndex::update_insert/update_delete exactly.
+//
+// A tree keeps only a byte per node for its top and its components as
+// circular lists in ceil(log2 n) bits per node; refine sums a component's
+// volume on the way. Overrides grow with every update, so once they take
+// more than their cap the index is rekeyed: every tree is drawn afresh
+// under a new seed and all overrides are dropped.
+class StackIndex_Keyed : public IndexMethod<Config> {
+public:
+    class StackTree {
+    public:
+        // how far each stack was read; 255 stands for big_tops[u]
+        std::vector<uint8_t> tops;
+        std::unordered_map<node_id, uint32_t> big_tops;
+        // the next node of u's component, round to its first again
+        PackedArray link;
+
+        StackTree() {}
+        StackTree(node_id num_nodes) : tops(num_nodes, 0), link(num_nodes, PackedArray::bits_for(std::max<node_id>(num_nodes, 1) - 1)) {}
+
+        uint32_t top(node_id u) const { return tops[u] < UINT8_MAX ? tops[u] : big_tops.at(u); }
+        void set_top(node_id u, uint32_t top) {
+            if(top >= UINT8_MAX) big_tops[u] = top;
+            tops[u] = std::min<uint32_t>(top, UINT8_MAX);
+        }
+    };
+
+    // explicit entries of a node from position 0 on, ahead of the keyed
+    // ones: those of tree t are entries[start[t], end[t])
+    class Overrides {
+    public:
+        std::vector<uint32_t> start, end;
+        std::vector<node_id> entries;
+
+        size_t size(size_t t) const { return end[t] - start[t]; }
+        node_id *begin(size_t t) { return entries.data() + start[t]; }
+        const node_id *begin(size_t t) const { return entries.data() + start[t]; }
+        size_t bytes() const { return (start.capacity() + end.capacity() + entries.capacity()) * sizeof(uint32_t); }
+    };
+
+    // scratch space of restack
+    class Workspace {
+    public:
+        std::vector<bool> intree;
+        std::vector<uint32_t> seen;
+        std::vector<node_id> next, root;
+
+        Workspace(node_id num_nodes) : intree(num_nodes,false), seen(num_nodes,0), next(num_nodes,-1), root(num_nodes,-1) {}
+    };
+
+public:
+    std::vector<StackTree> stack_index;
+    size_t num_stacks = 0;
+    uint64_t seed;
+    std::vector<uint32_t> epoch;
+    // nodes with an entry in overrides
+    std::vector<bool> overridden;
+    std::unordered_map<node_id, Overrides> overrides;
+    size_t override_bytes = 0, tree_bytes = 0;
+    size_t rekeys = 0;
+
+    StackIndex_Keyed(graph *G, Config *conf) : IndexMethod<Config>(G, conf), seed(rand_uint()), epoch(G->num_nodes(), 0), overridden(G->num_nodes(), false) {
+        conf->show();
+
+        printf("Building StackIndex_Keyed\n");
+        if(num_stacks == 0) num_stacks = conf->omega();
+        printf("omega: %zu\n", num_stacks);
+        Workspace ws(G->num_nodes());
+
+        Timer tmr(TIMER::BUILD);
+        stack_index.reserve(num_stacks);
+        for (size_t i = 0; i < num_stacks; i++) {
+            stack_index.emplace_back(G->num_nodes());
+            restack(i, ws);
+            tree_bytes += stack_index[i].tops.capacity() + stack_index[i].link.bytes();
+        }
+        printf("StackIndex_Keyed built, num_stacks: %zu\n", num_stacks);
+    }
+
+    MemoryUsage memory_usage() const {
+        MemoryUsage usage;
+        usage.add("epoch", epoch.capacity() * sizeof(uint32_t), epoch.size());
+        usage.add("overridden", overridden.capacity() / 8, overridden.size());
+        size_t entries = 0;
+        for(auto &[u, o] : overrides) entries += o.entries.size();
+        usage.add("overrides", hash_bytes(overrides) + override_bytes, entries);
+        for(auto &stacktree : stack_index){
+            usage.add("tops", stacktree.tops.capacity() + hash_bytes(stacktree.big_tops), stacktree.tops.size());
+            usage.add("links", stacktree.link.bytes(), stacktree.tops.size());
+        }
+        return usage;
+    }
+
+    // see StackIndex::num_used_stacks
+    size_t num_used_stacks() const {
+        return std::min(stack_index.size(), std::max<size_t>(1, conf->omega()));
+    }
+
+    void refine(ppr_vec &rsv, res_vec &rsd) {
+        size_t num_used = num_used_stacks();
+        size_t touched = 0, visited = 0;
+        for(node_id u=0;u<G->num_nodes();u++){
+            if(rsd[u] == 0) continue;
+            if(G->is_dangling_node(u)){
+                rsv[u] += rsd[u];
+            } else{
+                touched += num_used;
+                for(size_t i=0;i<num_used;i++){
+                    auto &link = stack_index[i].link;
+                    double vol = 0;
+                    node_id v = u;
+                    do{ vol += G->get_degree(v); v = link[v]; } while(v != u);
+                    do{
+                        rsv[v] += rsd[u] * G->get_degree(v) / (vol * num_used);
+                        visited++;
+                        v = link[v];
+                    } while(v != u);
+                }
+            }
+        }
+        metric_add(COUNTER::REFINE_COMPONENTS, touched);
+        metric_add(COUNTER::REFINE_NODES, visited);
+    }
+
+    // where u points in tree t (-1 at a root)
+    node_id next(size_t t, node_id u) const {
+        uint32_t top = stack_index[t].top(u);
+        if(top == 0 || G->is_dangling_node(u)) return -1;
+        return entry(t, u, top - 1, node_key(t, u));
+    }
+
+    node_id root(size_t t, node_id u) const {
+        for(node_id v; (v = next(t, u)) != (node_id)-1;) u = v;
+        return u;
+    }
+
+    // explicit entries are fixed termination or move decisions, so a new
+    // alpha starts over from a fresh key
+    void update_alpha(double alpha) {
+        Timer tmr(TIMER::UPDATE);
+        if(alpha == conf->alpha) return;
+        conf->alpha = alpha;
+        rekey();
+        printf("StackIndex_Keyed updated, num_stacks: %zu\n", num_stacks);
+    }
+
+    // G already holds (a, b) as a's last neighbour. As in StackIndex, every
+    // move entry of a turns into b with prob 1/deg(a) and terminations stay;
+    // a tree changes from its first converted entry, and if a was dangling
+    // every tree draws a's entries afresh.
+    void update_insert(node_id a, node_id b, edge_sno){
+        edge_sno old_deg = G->get_degree(a) - 1;
+        Workspace ws(G->num_nodes());
+        if(old_deg == 0){
+            epoch[a]++;
+            drop_overrides(a);
+            for(size_t i=0;i<stack_index.size();i++) restack(i, ws);
+            return;
+        }
+        freeze(a, old_deg, [&](edge_sno k){ return G->get_neighbour(a, k); });
+        if(override_bytes > override_cap()){
+            rekey();
+            return;
+        }
+
+        Overrides &o = overrides[a];
+        for(size_t i=0;i<stack_index.size();i++){
+            if(o.size(i) == 0) continue;
+            node_id *s = o.begin(i);
+            size_t moves = s[o.size(i) - 1] == (node_id)-1 ? o.size(i) - 1 : o.size(i);
+            uint32_t first_appear_index = rand_geometric(1.0/G->get_degree(a)) - 1;
+            if(first_appear_index >= moves) continue;
+            s[first_appear_index] = b;
+            o.end[i] = o.start[i] + first_appear_index + 1;
+            restack(i, ws);
+        }
+    }
+
+    // G already dropped (a, b) from slot es, moving a's last neighbour
+    // there. As in StackIndex, every entry of b is redrawn over the
+    // neighbours left and the rest of the stack stays; if a is left
+    // dangling its entries are dropped.
+    void update_delete(node_id a, node_id b, edge_sno es){
+        edge_sno old_deg = G->get_degree(a) + 1;
+        freeze(a, old_deg, [&](edge_sno k){
+            if(k == es) return b;
+            return G->get_neighbour(a, k == old_deg - 1 ? es : k);
+        });
+        if(override_bytes > override_cap()){
+            rekey();
+            return;
+        }
+
+        Workspace ws(G->num_nodes());
+        Overrides &o = overrides[a];
+        for(size_t i=0;i<stack_index.size();i++){
+            node_id *s = o.begin(i), *e = s + o.size(i);
+            if(std::find(s, e, b) == e) continue;
+            if(!G->is_dangling_node(a)){
+                for(; s != e; s++){
+                    if(*s == b) *s = G->get_neighbour(a, rand_uniform(G->get_degree(a)));
+                }
+            }
+            restack(i, ws);
+        }
+        if(G->is_dangling_node(a)) drop_overrides(a);
+    }
+
+private:
+    // overrides may take as many bytes as the trees themselves, or
+    // conf->stack_memory_target when set
+    size_t override_cap() const {
+        return conf->stack_memory_target ? conf->stack_memory_target : tree_bytes;
+    }
+
+    // every tree drawn afresh on the current graph under a new seed, which
+    // no override is needed for
+    void rekey() {
+        seed = rand_keyed(seed, 0);
+        overrides.clear();
+        override_bytes = 0;
+        std::fill(overridden.begin(), overridden.end(), false);
+        Workspace ws(G->num_nodes());
+        for(size_t i=0;i<stack_index.size();i++) restack(i, ws);
+        rekeys++;
+    }
+
+    void drop_overrides(node_id a) {
+        auto it = overrides.find(a);
+        if(it == overrides.end()) return;
+        override_bytes -= it->second.bytes();
+        overrides.erase(it);
+        overridden[a] = false;
+    }
+
+    uint64_t node_key(size_t t, node_id u) const {
+        return rand_keyed(rand_keyed(seed, t), ((uint64_t)epoch[u] << 32) | u);
+    }
+
+    // keyed entry i of u over a neighbourhood of deg nodes given by nb
+    template <typename F>
+    node_id draw(uint64_t key, size_t i, edge_sno deg, F nb) const {
+        uint64_t h = rand_keyed(key, i);
+        if((uint32_t)(h >> 32) < std::min(conf->alpha * 0x1.0p32, 4294967295.)) return -1;
+        return nb(((h & 0xffffffffull) * deg) >> 32);
+    }
+
+    node_id entry(size_t t, node_id u, size_t i, uint64_t key) const {
+        if(overridden[u]){
+            const Overrides &o = overrides.find(u)->second;
+            if(i < o.size(t)) return o.begin(t)[i];
+        }
+        return draw(key, i, G->get_degree(u), [&](edge_sno k){ return G->get_neighbour(u, k); });
+    }
+
+    // a's adjacency changed from the deg old_nb nodes: store the entries
+    // its trees consumed as overrides, then key later entries anew
+    template <typename F>
+    void freeze(node_id a, edge_sno deg, F old_nb) {
+        auto it = overrides.find(a);
+        const Overrides *old = it == overrides.end() ? nullptr : &it->second;
+        Overrides o;
+        o.start.resize(stack_index.size());
+        o.end.resize(stack_index.size());
+        for(size_t t=0;t<stack_index.size();t++){
+            uint32_t top = stack_index[t].top(a);
+            o.start[t] = o.entries.size();
+            size_t kept = old ? std::min<size_t>(old->size(t), top) : 0;
+            if(kept) o.entries.insert(o.entries.end(), old->begin(t), old->begin(t) + kept);
+            uint64_t key = node_key(t, a);
+            for(size_t i=kept;i<top;i++) o.entries.push_back(draw(key, i, deg, old_nb));
+            o.end[t] = o.entries.size();
+        }
+        o.entries.shrink_to_fit();
+        drop_overrides(a);
+        override_bytes += o.bytes();
+        overrides[a] = std::move(o);
+        overridden[a] = true;
+        epoch[a]++;
+    }
+
+    // Rebuild tree t by cycle popping over its (regenerated) stacks; tops
+    // record how far each stack was read, and link runs through each
+    // component from its root.
+    void restack(size_t t, Workspace &ws) {
+        StackTree &stacktree = stack_index[t];
+        std::fill(ws.intree.begin(),ws.intree.end(),false);
+        std::fill(ws.seen.begin(),ws.seen.end(),0);
+
+        for (node_id u = 0; u < G->num_nodes(); u++) {
+            if(ws.intree[u]) continue;
+            node_id current = u;
+
+            while (!ws.intree[current]) {
+                if(G->is_dangling_node(current)){
+                    ws.next[current] = -1;
+                    break;
+                }
+                ws.next[current] = entry(t, current, ws.seen[current]++, node_key(t, current));
+                if(ws.next[current] == (node_id)-1) break;
+                current = ws.next[current];
+            }
+
+            node_id last = current;
+            current = u;
+            while (current != last) {
+                ws.intree[current] = true;
+                current = ws.next[current];
+            }
+            ws.intree[last] = true;
+        }
+
+        std::fill(ws.root.begin(), ws.root.end(), (node_id)-1);
+        for (node_id u = 0; u < G->num_nodes(); u++) {
+            node_id r = u;
+            while (ws.root[r] == (node_id)-1 && ws.next[r] != (node_id)-1) r = ws.next[r];
+            if (ws.root[r] != (node_id)-1) r = ws.root[r];
+            for (node_id v = u; ws.root[v] == (node_id)-1; v = ws.next[v]) {
+                ws.root[v] = r;
+                if (v == r) break;
+            }
+        }
+        for (node_id u = 0; u < G->num_nodes(); u++) {
+            if (ws.root[u] == u) stacktree.link.set(u, u);
+        }
+        for (node_id u = 0; u < G->num_nodes(); u++) {
+            node_id r = ws.root[u];
+            if (r == u) continue;
+            stacktree.link.set(u, stacktree.link[r]);
+            stacktree.link.set(r, u);
+        }
+
+        stacktree.big_tops.clear();
+        for (node_id u = 0; u < G->num_nodes(); u++) {
+            stacktree.set_top(u, ws.seen[u]);
+        }
+    }
+};
@@ -1,16 +1,20 @@
 #pragma once
 
 #include "graph.hpp"
+#include "lib/memory_usage.hpp"
 #include "lib/scarray.hpp"
 #include "log/log.h"
 #include "time/timer.hpp"
 #include "uniqueue.hpp"
 #include <assert.h>
 #include <cmath>
+#include <stdexcept>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include <functional>
+#include <algorithm>
+#include <numeric>
 
 
 using ppr_vec = std::vector<double>;
@@ -25,6 +29,14 @@ public:
     double det_exp = 1.0;
     double det_fac = 1.0;
     double pf_exp = 1.0;
+    size_t num_threads = 1;
+    bool lazy_repair = false; // defer tree repairs of dynamic indexes until a query needs them
+    size_t repair_threads = 0; // background tree repair workers of dynamic indexes, 0 repairs in place
+    bool skip_insert_sampling = true; // StackIndex inserts skip straight to the affected trees
+    bool fuse_undirected = true; // update both directions of an undirected edge at once where supported
+    size_t stack_memory_target = 0; // bytes of stack columns StackIndex compacts towards, 0 never compacts; StackIndex_Keyed rekeys past it in overrides
+    bool drop_next = false; // StackIndex keeps no next array per tree and derives it from the stacks
+    size_t build_memory_budget = 0; // bytes of trees a StackIndex build stops short of, lowering omega; 0 builds all
 
 public:
     Config() = default;
@@ -37,7 +49,7 @@ public:
     }
 
     void show(){
-        fprintf(stdout, "is_dird: %d, alpha: %lf, eps: %lf, delta: %lf, pf: %lf, rmax: %lf\n", is_dird, alpha, eps, delta, pf, rmax);
+        fprintf(stdout, "is_dird: %d, alpha: %lf, eps: %lf, delta: %lf, pf: %lf, rmax: %lf, num_threads: %zu, lazy_repair: %d, repair_threads: %zu, skip_insert_sampling: %d, fuse_undirected: %d, stack_memory_target: %zu, drop_next: %d, build_memory_budget: %zu\n", is_dird, alpha, eps, delta, pf, rmax, num_threads, lazy_repair, repair_threads, skip_insert_sampling, fuse_undirected, stack_memory_target, drop_next, build_memory_budget);
     }
 };
 
@@ -48,23 +60,46 @@ public:
     CONF *conf = nullptr;
     IndexMethod() = default;
     IndexMethod(graph *G, CONF *conf) : G(G), conf(conf) {}
+    virtual ~IndexMethod() = default;
     virtual void refine(ppr_vec &reserve, res_vec &residue) {}
+    // indexes built for a single alpha only serve conf->alpha; FORA checks
+    // serves_alpha before a query, so refine never sees another one
+    virtual bool serves_alpha(double alpha) const { return std::abs(alpha - conf->alpha) < 1e-9; }
+    virtual void refine(ppr_vec &reserve, res_vec &residue, double alpha) { refine(reserve, residue); }
+    // Indexes whose estimate averages i.i.d. samples (trees, walk rounds)
+    // expose them one by one, so that refine can be carried out progressively.
+    virtual size_t num_samples() const { return 0; }
+    virtual void refine_sample(size_t i, ppr_vec &reserve, const res_vec &residue) {}
     virtual void update_alpha(double alpha) {}
     virtual void update_insert(node_id u, node_id v, edge_sno es) {}
     virtual void update_delete(node_id u, node_id v, edge_sno es) {}
+    // Indexes that repair once for both directions of an undirected edge
+    // return true here, and FORA then changes G in both directions first.
+    virtual bool fuses_undirected() const { return false; }
+    virtual void update_insert_undirected(node_id u, node_id v, edge_sno uv, edge_sno vu) {}
+    virtual void update_delete_undirected(node_id u, node_id v, edge_sno uv, edge_sno vu) {}
+    // bracket every change of G and the index, for indexes with background work
+    virtual void begin_update() {}
+    virtual void end_update() {}
+    // bytes and element counts of the parts of the index, G not included
+    virtual MemoryUsage memory_usage() const { return {}; }
 };
 
 template <typename CONF>
 class FORA {
 private:
     using outputer = std::function<void(const std::vector<double> &)>;
+    // receives the number of samples refined, the estimate and per-node error
+    // bounds, and returns false to stop refining
+    using progress_outputer = std::function<bool(size_t, const ppr_vec &, const std::vector<double> &)>;
 
-    void _forward_push(IndexMethod<CONF> *f, node_id s, ppr_vec &rsv, ppr_vec &rsd) {
+    void _forward_push(IndexMethod<CONF> *f, node_id s, double alpha, ppr_vec &rsv, ppr_vec &rsd) {
         // forward-push
         graph *G = f->G;
         static uniqueue push_queue(G->num_nodes());
         double rmax = f->conf->rmax;
         Timer tmr(TIMER::PUSH);
+        metric_add(COUNTER::QUERIES, 1);
 
         if (G->is_dangling_node(s)){
             rsv[s] = 1.0;
@@ -75,11 +110,14 @@ private:
             if (rsd[s] >= rmax * G->get_degree(s))
                 push_queue.push(s);
         }
+        size_t pushes = 0, scanned = 0;
         while (!push_queue.empty()) {
             node_id u = push_queue.pop();
-            rsv[u] += f->conf->alpha * rsd[u];
+            pushes++;
+            scanned += G->get_degree(u);
+            rsv[u] += alpha * rsd[u];
             // dangling node cannot be in queue
-            double detr = (1 - f->conf->alpha) * rsd[u] / G->get_degree(u);
+            double detr = (1 - alpha) * rsd[u] / G->get_degree(u);
             log_trace("on node %zu, rsd = %e, inc = %e", (size_t)u, rsd[u], detr);
             rsd[u] = 0;
 
@@ -94,21 +132,28 @@ private:
                 }
             }
         }
+        metric_add(COUNTER::PUSHES, pushes);
+        metric_add(COUNTER::EDGES_SCANNED, scanned);
+        metric_add(SUM::RESIDUE_LEFT, std::accumulate(rsd.begin(), rsd.end(), 0.0));
     }
 
-    void _refine(IndexMethod<CONF> *f, ppr_vec &rsv, ppr_vec &rsd) {
+    void _refine(IndexMethod<CONF> *f, double alpha, ppr_vec &rsv, ppr_vec &rsd) {
         Timer tmr(TIMER::REFINE);
-        f->refine(rsv, rsd);
+        f->refine(rsv, rsd, alpha);
     }
 
-    void _evaluate(IndexMethod<CONF> *f, node_id s, ppr_vec &rsv, ppr_vec &rsd) {
+    void _evaluate(IndexMethod<CONF> *f, node_id s, double alpha, ppr_vec &rsv, ppr_vec &rsd) {
+        if (!f->serves_alpha(alpha)) {
+            log_error("alpha %lf is not served by the index", alpha);
+            throw std::out_of_range("alpha is not served by the index");
+        }
         Timer tmr(TIMER::EVALUATE);
 
         log_debug("forward pushing");
-        _forward_push(f, s, rsv, rsd);
+        _forward_push(f, s, alpha, rsv, rsd);
 
         log_debug("refining estimation");
-        _refine(f, rsv, rsd);
+        _refine(f, alpha, rsv, rsd);
     }
 
     void _output(outputer output, const ppr_vec &ppr) {
@@ -117,29 +162,130 @@ private:
     }
 
 public:
+    // the forward push of a query on its own, for benchmarks; rsv and rsd
+    // start out zero and end up with the reserves and residues
+    void forward_push(IndexMethod<CONF> *f, node_id s, ppr_vec &rsv, ppr_vec &rsd) {
+        _forward_push(f, s, f->conf->alpha, rsv, rsd);
+    }
+
     void evaluate_noprint(IndexMethod<CONF> *f, node_id s, outputer output) {
+        evaluate_noprint(f, s, f->conf->alpha, output);
+    }
+
+    void evaluate(IndexMethod<CONF> *f, node_id s, outputer output) {
+        evaluate(f, s, f->conf->alpha, output);
+    }
+
+    // evaluate with a per-query alpha, which f must serve
+    void evaluate_noprint(IndexMethod<CONF> *f, node_id s, double alpha, outputer output) {
         ppr_vec rsv(f->G->num_nodes(), 0);
         ppr_vec rsd(f->G->num_nodes(), 0);
 
-        _evaluate(f, s, rsv, rsd);
+        _evaluate(f, s, alpha, rsv, rsd);
         _output(output, rsv);
     }
 
-    void evaluate(IndexMethod<CONF> *f, node_id s, outputer output) {
+    void evaluate(IndexMethod<CONF> *f, node_id s, double alpha, outputer output) {
         ppr_vec rsv(f->G->num_nodes(), 0);
         ppr_vec rsd(f->G->num_nodes(), 0);
 
-        _evaluate(f, s, rsv, rsd);
+        _evaluate(f, s, alpha, rsv, rsd);
         _output(output, rsv);
         fprintf(stdout, "evaluation time: %lf\n", Timer::used(TIMER::EVALUATE));
         fprintf(stdout, "forward-push time: %lf\n", Timer::used(TIMER::PUSH));
         fprintf(stdout, "refine time: %lf\n", Timer::used(TIMER::REFINE));
     }
 
+    // Anytime evaluation: push once, then refine over the samples of f in
+    // batches. After each batch, output gets the estimate so far and, per node,
+    // an empirical Bernstein bound on its refine error holding with prob
+    // 1 - delta. Indexes without samples are refined in one go.
+    void evaluate_progressive(IndexMethod<CONF> *f, node_id s, size_t batch, double delta, progress_outputer output) {
+        node_id n = f->G->num_nodes();
+        ppr_vec rsv(n, 0);
+        ppr_vec rsd(n, 0);
+        Timer tmr(TIMER::EVALUATE);
+
+        _forward_push(f, s, f->conf->alpha, rsv, rsd);
+
+        size_t total = f->num_samples();
+        if (total == 0) {
+            _refine(f, f->conf->alpha, rsv, rsd);
+            Timer tmr_output(TIMER::OUTPUT);
+            output(0, rsv, std::vector<double>(n, 0));
+            return;
+        }
+
+        // every sample puts at most the residue mass on a node
+        double range = 0;
+        for (node_id u = 0; u < n; u++) range += rsd[u];
+        double logd = log(4 / delta);
+
+        ppr_vec x(n, 0), sum(n, 0), sumsq(n, 0), est(n, 0);
+        std::vector<double> bound(n, range);
+        for (size_t k = 0; k < total;) {
+            {
+                Timer tmr_refine(TIMER::REFINE);
+                for (size_t end = std::min(total, k + std::max<size_t>(batch, 1)); k < end; k++) {
+                    f->refine_sample(k, x, rsd);
+                    for (node_id v = 0; v < n; v++) {
+                        if (x[v] == 0) continue;
+                        sum[v] += x[v];
+                        sumsq[v] += x[v] * x[v];
+                        x[v] = 0;
+                    }
+                }
+                for (node_id v = 0; v < n; v++) {
+                    est[v] = rsv[v] + sum[v] / k;
+                    if (k < 2) continue;
+                    double var = std::max(0., (sumsq[v] - sum[v] * sum[v] / k) / (k - 1));
+                    bound[v] = std::min(range, sqrt(2 * var * logd / k) + 7 * range * logd / (3 * (k - 1)));
+                }
+            }
+            Timer tmr_output(TIMER::OUTPUT);
+            if (!output(k, est, bound)) break;
+        }
+    }
+
+    // the largest bound among the k nodes with the highest estimates
+    static double topk_bound(const ppr_vec &est, const std::vector<double> &bound, size_t k) {
+        std::vector<node_id> ids(est.size());
+        for (node_id v = 0; v < est.size(); v++) ids[v] = v;
+        k = std::min(k, ids.size());
+        std::nth_element(ids.begin(), ids.begin() + k, ids.end(),
+            [&est](node_id a, node_id b) { return est[a] > est[b]; });
+        double ret = 0;
+        for (size_t i = 0; i < k; i++) ret = std::max(ret, bound[ids[i]]);
+        return ret;
+    }
+
     void insert_edge(node_id u, node_id v, IndexMethod<CONF> *I) {
         Timer tmr(TIMER::UPDATE);
+        I->begin_update();
+        _insert_edge(u, v, I);
+        I->end_update();
+    }
+
+    void delete_edge(node_id u, node_id v, IndexMethod<CONF> *I) {
+        Timer tmr(TIMER::UPDATE);
+        I->begin_update();
+        _delete_edge(u, v, I);
+        I->end_update();
+    }
+
+private:
+    void _insert_edge(node_id u, node_id v, IndexMethod<CONF> *I) {
         std::optional<edge_sno> esno = I->G->insert_edge(u, v);
         if (!esno) return;
+        if (!I->conf->is_dird && u != v && I->fuses_undirected()) {
+            std::optional<edge_sno> rev = I->G->insert_edge(v, u);
+            if (!rev) {
+            log_fatal("fail to insert duel edge <%zu, %zu>", (size_t)u, (size_t)v);
+            exit(1);
+            }
+            I->update_insert_undirected(u, v, esno.value(), rev.value());
+            return;
+        }
         I->update_insert(u, v, esno.value());
         if (!I->conf->is_dird && u != v) {
             esno = I->G->insert_edge(v, u);
@@ -151,10 +297,18 @@ public:
         }
     }
 
-  void delete_edge(node_id u, node_id v, IndexMethod<CONF> *I) {
-    Timer tmr(TIMER::UPDATE);
+  void _delete_edge(node_id u, node_id v, IndexMethod<CONF> *I) {
     std::optional<edge_sno> esno = I->G->delete_edge(u, v);
     if (!esno) return;
+    if (!I->conf->is_dird && u != v && I->fuses_undirected()) {
+      std::optional<edge_sno> rev = I->G->delete_edge(v, u);
+      if (!rev) {
+        log_fatal("fail to delete duel edge <%zu, %zu>", (size_t)u, (size_t)v);
+        exit(1);
+      }
+      I->update_delete_undirected(u, v, esno.value(), rev.value());
+      return;
+    }
     I->update_delete(u, v, esno.value());
     if (!I->conf->is_dird && u != v) {
       esno = I->G->delete_edge(v, u);
@@ -5,6 +5,7 @@
 #include <optional>
 #include <unordered_map>
 #include <vector>
+#include "lib/memory_usage.hpp"
 #include "lib/scarray.hpp"
 #include "graph_types.hpp"
 
@@ -84,6 +85,19 @@ public:
     return std::make_optional(esno);
   }
 
+  MemoryUsage memory_usage() const {
+    MemoryUsage usage;
+    size_t adjacency = _edge_list.capacity() * sizeof(scarray<node_id>);
+    size_t table = _edge_table.capacity() * sizeof(std::unordered_map<node_id, edge_sno>);
+    for (node_id v = 0; v < _n_nodes; ++v) {
+      adjacency += _edge_list[v].capacity() * sizeof(node_id);
+      table += hash_bytes(_edge_table[v]);
+    }
+    usage.add("adjacency", adjacency, _n_edges);
+    usage.add("edge_table", table, _n_edges);
+    return usage;
+  }
+
   void swap_edge(node_id u, edge_sno esno, edge_sno eesno) {
     _edge_list[u].swap(esno, eesno,
       [this, u, esno, eesno](node_id vv, node_id v) {
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Bytes and element counts of the parts of an index or a graph.
+ *
+ * Parts are flat and named by path, like "stacks/entries"; add() folds a
+ * part into an earlier one of the same name, so loops over trees or nodes
+ * can report into one part each.
+ */
+class MemoryUsage {
+public:
+  struct Part {
+    std::string name;
+    size_t bytes = 0;
+    size_t count = 0;
+  };
+
+  void add(const std::string& name, size_t bytes, size_t count) {
+    for (auto& p : _parts) {
+      if (p.name == name) {
+        p.bytes += bytes;
+        p.count += count;
+        return;
+      }
+    }
+    _parts.push_back({name, bytes, count});
+  }
+
+  // the parts of other, under prefix/
+  void add(const std::string& prefix, const MemoryUsage& other) {
+    for (auto& p : other._parts) add(prefix + "/" + p.name, p.bytes, p.count);
+  }
+
+  size_t total() const {
+    size_t bytes = 0;
+    for (auto& p : _parts) bytes += p.bytes;
+    return bytes;
+  }
+
+  const std::vector<Part>& parts() const { return _parts; }
+
+  // {"total_bytes": .., "parts": {"<name>": {"bytes": .., "count": ..}, ..}}
+  std::string json() const {
+    std::string s = "{\"total_bytes\": " + std::to_string(total()) + ", \"parts\": {";
+    for (size_t i = 0; i < _parts.size(); ++i) {
+      if (i) s += ", ";
+      s += "\"" + _parts[i].name + "\": {\"bytes\": " + std::to_string(_parts[i].bytes) +
+           ", \"count\": " + std::to_string(_parts[i].count) + "}";
+    }
+    return s + "}}";
+  }
+
+private:
+  std::vector<Part> _parts;
+};
+
+// heap bytes of an unordered container: its buckets and one node per element
+template <typename H>
+size_t hash_bytes(const H& h) {
+  return h.bucket_count() * sizeof(void*) + h.size() * (sizeof(void*) + sizeof(typename H::value_type));
+}
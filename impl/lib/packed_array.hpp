@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Unsigned integers of a fixed number of bits each, packed back to
+ * back into 64-bit words.
+ *
+ * Node ids below n take bits_for(n - 1) bits instead of 32, so an array of
+ * them shrinks with the graph. One word of padding lets a read take the
+ * two words a value may straddle without a bounds check.
+ */
+class PackedArray {
+public:
+  PackedArray() = default;
+  PackedArray(size_t n, unsigned bits) : _bits(bits), _words((n * bits + 63) / 64 + 1, 0) {}
+
+  // the bits needed for values up to max
+  static unsigned bits_for(uint64_t max) {
+    unsigned bits = 1;
+    while (bits < 64 && (max >> bits)) ++bits;
+    return bits;
+  }
+
+  uint64_t operator[](size_t i) const {
+    size_t bit = i * _bits, w = bit >> 6, o = bit & 63;
+    uint64_t v = _words[w] >> o;
+    if (o + _bits > 64) v |= _words[w + 1] << (64 - o);
+    return v & mask();
+  }
+
+  void set(size_t i, uint64_t v) {
+    size_t bit = i * _bits, w = bit >> 6, o = bit & 63;
+    _words[w] = (_words[w] & ~(mask() << o)) | (v << o);
+    if (o + _bits > 64) {
+      size_t s = 64 - o;
+      _words[w + 1] = (_words[w + 1] & ~(mask() >> s)) | (v >> s);
+    }
+  }
+
+  size_t bytes() const { return _words.capacity() * sizeof(uint64_t); }
+
+private:
+  uint64_t mask() const { return _bits == 64 ? ~0ull : (1ull << _bits) - 1; }
+
+  unsigned _bits = 1;
+  std::vector<uint64_t> _words;
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "time/perf_counters.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Long-lived workers running f(i, w) for every i in [0, n).
+ *
+ * Indexes run a parallel loop on every update, where starting and joining
+ * threads would cost as much as repairing a few small trees, so the
+ * workers are started once and wait between calls of run().
+ *
+ * Items are handed out one at a time, and w in [0, size()) names the
+ * worker running the item, so callers can keep per-worker scratch space.
+ * The calling thread serves as worker 0, and run() returns once every
+ * item is done.
+ */
+class WorkerPool {
+public:
+  explicit WorkerPool(size_t num_workers) : _num_workers(std::max<size_t>(1, num_workers)) {
+    for (size_t w = 1; w < _num_workers; ++w) _threads.emplace_back([this, w] { serve(w); });
+  }
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lk(_mutex);
+      _stopping = true;
+    }
+    _cv.notify_all();
+    for (auto& t : _threads) t.join();
+  }
+
+  size_t size() const { return _num_workers; }
+
+  template <typename F>
+  void run(size_t n, F f) {
+    if (_num_workers <= 1 || n <= 1) {
+      for (size_t i = 0; i < n; ++i) f(i, 0);
+      return;
+    }
+
+    std::atomic<size_t> next{0};
+    auto work = [&](size_t w) {
+      for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < n;)
+        f(i, w);
+    };
+
+    {
+      std::lock_guard<std::mutex> lk(_mutex);
+      _job = work;
+      _pending = _num_workers - 1;
+      ++_generation;
+    }
+    _cv.notify_all();
+    work(0);
+
+    std::unique_lock<std::mutex> lk(_mutex);
+    _done.wait(lk, [this] { return _pending == 0; });
+    _job = nullptr;
+  }
+
+private:
+  void serve(size_t w) {
+    PerfCounters::attach();
+    size_t generation = 0;
+    std::unique_lock<std::mutex> lk(_mutex);
+    while (true) {
+      _cv.wait(lk, [&] { return _stopping || _generation != generation; });
+      if (_stopping) return;
+      generation = _generation;
+      lk.unlock();
+      _job(w);
+      lk.lock();
+      if (--_pending == 0) _done.notify_one();
+    }
+  }
+
+  size_t _num_workers;
+  std::vector<std::thread> _threads;
+
+  std::mutex _mutex;  // guards everything below
+  std::condition_variable _cv, _done;
+  std::function<void(size_t)> _job;
+  size_t _pending = 0, _generation = 0;
+  bool _stopping = false;
+};
+
+/**
+ * @brief The pool in p, (re)started with num_workers workers if it has
+ * another size, e.g. after conf->num_threads changed.
+ */
+inline WorkerPool& worker_pool(std::unique_ptr<WorkerPool>& p, size_t num_workers) {
+  num_workers = std::max<size_t>(1, num_workers);
+  if (!p || p->size() != num_workers) p = std::make_unique<WorkerPool>(num_workers);
+  return *p;
+}
@@ -4,7 +4,8 @@
 #include <cstdint>
 #include <random>
 
-std::mt19937 rand_uint{(std::random_device())()};
+// every thread draws from its own generator
+thread_local std::mt19937 rand_uint{(std::random_device())()};
 
 double rand_uniformf() {
   return 0x1.0p-32 * rand_uint();
@@ -39,3 +40,26 @@ uint32_t rand_binomial(uint32_t n, double p) {
     i += rand_geometric(p);
   return k - 1;
 }
+
+// counter-based draws: the same (key, ctr) always yields the same value, so a
+// random sequence can be replayed or resumed without being stored
+uint64_t rand_keyed(uint64_t key, uint64_t ctr) {
+  uint64_t z = key + (ctr + 1) * 0x9e3779b97f4a7c15;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+uint32_t rand_keyed_uniform(uint64_t key, uint64_t ctr, uint32_t n) {
+  return ((unsigned __int128)rand_keyed(key, ctr) * n) >> 64;
+}
+
+// geometric draws sharing a key are coupled: a smaller p never gives a
+// smaller result
+uint32_t rand_keyed_geometric(uint64_t key, uint64_t ctr, double p) {
+  if (p == 1) return 1;
+  uint32_t x = rand_keyed(key, ctr) >> 32;
+  if (x == 0) x = 1;
+  double u = 0x1.0p-32 * x;
+  return (uint32_t)ceil(std::log(u) / std::log(1 - p));
+}
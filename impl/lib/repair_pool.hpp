@@ -0,0 +1,164 @@
+#pragma once
+
+#include "time/timer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Background workers repairing the trees of a dynamic index.
+ *
+ * Updates hand over the trees they changed through mark(), and the workers
+ * repair them in order. A tree a query needs before a worker got to it is
+ * repaired by the querying thread in wait(); a tree a worker is repairing
+ * makes wait() block until it is done. Everything but the workers runs on
+ * one caller thread, and each update runs between begin_update() and
+ * end_update(), which holds back the workers (and waits for the repairs in
+ * flight) so that the graph and stacks never change under them.
+ */
+class RepairPool {
+public:
+  using repair_fn = std::function<void(size_t, std::vector<bool>&, std::vector<size_t>&)>;
+
+  struct Stats {
+    size_t queue_depth = 0;      // trees waiting for a worker now
+    size_t max_queue_depth = 0;
+    size_t repairs = 0;          // by the workers
+    size_t caller_repairs = 0;   // by queries that could not wait
+    double repair_time = 0;      // spent by the workers
+    double lag_sum = 0;          // from a tree turning dirty to its repair
+    double lag_max = 0;
+  };
+
+  RepairPool(size_t num_trees, size_t num_workers, repair_fn repair)
+      : _repair(std::move(repair)), _tree_mutex(num_trees),
+        _dirty(num_trees, false), _queued(num_trees, false), _since(num_trees) {
+    for (size_t w = 0; w < num_workers; ++w) _workers.emplace_back([this] { work(); });
+  }
+
+  ~RepairPool() {
+    {
+      std::lock_guard<std::mutex> lk(_mutex);
+      _stopping = true;
+    }
+    _cv.notify_all();
+    for (auto& t : _workers) t.join();
+  }
+
+  void begin_update() {
+    std::unique_lock<std::mutex> lk(_mutex);
+    _updating = true;
+    _cv.wait(lk, [this] { return _active == 0; });
+  }
+
+  void end_update() {
+    {
+      std::lock_guard<std::mutex> lk(_mutex);
+      _updating = false;
+    }
+    _cv.notify_all();
+  }
+
+  // tree i changed, called inside an update
+  void mark(size_t i) {
+    std::lock_guard<std::mutex> lk(_mutex);
+    if (!_dirty[i]) {
+      _dirty[i] = true;
+      _since[i] = clock::now();
+    }
+    if (!_queued[i]) {
+      _queued[i] = true;
+      _queue.push_back(i);
+      _stats.max_queue_depth = std::max(_stats.max_queue_depth, _queue.size());
+    }
+  }
+
+  // return once tree i is repaired, repairing it here if no worker has
+  void wait(size_t i, std::vector<bool>& intree, std::vector<size_t>& seen) {
+    std::lock_guard<std::mutex> tl(_tree_mutex[i]);
+    {
+      std::lock_guard<std::mutex> lk(_mutex);
+      if (!_dirty[i]) return;
+    }
+    Timer tmr(TIMER::REPAIR);
+    _repair(i, intree, seen);
+    std::lock_guard<std::mutex> lk(_mutex);
+    repaired(i);
+    _stats.caller_repairs++;
+  }
+
+  Stats stats() {
+    std::lock_guard<std::mutex> lk(_mutex);
+    Stats s = _stats;
+    s.queue_depth = _queue.size();
+    return s;
+  }
+
+private:
+  using clock = std::chrono::steady_clock;
+  using duration = std::chrono::duration<double>;
+
+  void repaired(size_t i) {
+    _dirty[i] = false;
+    double lag = duration(clock::now() - _since[i]).count();
+    _stats.lag_sum += lag;
+    _stats.lag_max = std::max(_stats.lag_max, lag);
+  }
+
+  void work() {
+    PerfCounters::attach();
+    std::vector<bool> intree;
+    std::vector<size_t> seen;
+    std::unique_lock<std::mutex> lk(_mutex);
+    while (true) {
+      _cv.wait(lk, [this] { return _stopping || (!_updating && !_queue.empty()); });
+      if (_stopping) return;
+      size_t i = _queue.front();
+      _queue.pop_front();
+      _queued[i] = false;
+      _active++;
+      lk.unlock();
+
+      {
+        std::lock_guard<std::mutex> tl(_tree_mutex[i]);
+        bool dirty;
+        {
+          std::lock_guard<std::mutex> dl(_mutex);
+          dirty = _dirty[i];
+        }
+        if (dirty) {
+          auto start = clock::now();
+          _repair(i, intree, seen);
+          double t = duration(clock::now() - start).count();
+          std::lock_guard<std::mutex> dl(_mutex);
+          repaired(i);
+          _stats.repairs++;
+          _stats.repair_time += t;
+        }
+      }
+
+      lk.lock();
+      _active--;
+      if (_active == 0 && _updating) _cv.notify_all();
+    }
+  }
+
+  repair_fn _repair;
+  std::vector<std::thread> _workers;
+  std::vector<std::mutex> _tree_mutex;
+
+  std::mutex _mutex;  // guards everything below
+  std::condition_variable _cv;
+  std::deque<size_t> _queue;
+  std::vector<bool> _dirty, _queued;
+  std::vector<clock::time_point> _since;
+  size_t _active = 0;
+  bool _updating = false, _stopping = false;
+  Stats _stats;
+};
@@ -160,6 +160,10 @@ public:
     return _end - _begin;
   }
 
+  constexpr size_t capacity() const noexcept {
+    return _limit - _begin;
+  }
+
   constexpr pointer begin() noexcept {
     return _begin;
   }
@@ -16,4 +16,15 @@ protected:
       if (rand_uniformf() < alpha) return v;
     };
   }
+
+  // replay steps (from, to] of the keyed walk currently at v; the walk stops
+  // early on a dangling node, just as random_walk does
+  node_id replay_walk(graph* const g, node_id v, uint64_t key,
+      uint32_t from, uint32_t to) const {
+    for (; from < to; ++from) {
+      if (g->is_dangling_node(v)) return v;
+      v = g->get_neighbour(v, rand_keyed_uniform(key, from + 1, g->get_degree(v)));
+    }
+    return v;
+  }
 };
@@ -0,0 +1,293 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Query-path counters and per-phase latency histograms. They are compiled in
+// with -DMETRICS (make METRICS=-DMETRICS); otherwise every metric_* macro is
+// (0) and its arguments are never evaluated.
+
+enum struct COUNTER : size_t {
+  QUERIES, PUSHES, EDGES_SCANNED, REFINE_NODES, REFINE_COMPONENTS, _
+};
+
+enum struct SUM : size_t {
+  RESIDUE_LEFT, _
+};
+
+// what every per-thread slot carries, see PerThread
+struct ThreadSlot {
+  std::atomic<bool> owned{false};
+  const bool shared;
+
+  explicit ThreadSlot(bool shared = false) : shared(shared) {}
+
+  // add n to a, which only the owner writes unless the slot is shared
+  void bump(std::atomic<uint64_t>& a, uint64_t n) {
+    if (shared) a.fetch_add(n, std::memory_order_relaxed);
+    else a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  void bump(std::atomic<double>& a, double x) {
+    if (shared) a.fetch_add(x, std::memory_order_relaxed);
+    else a.store(a.load(std::memory_order_relaxed) + x, std::memory_order_relaxed);
+  }
+};
+
+/**
+ * @brief One slot of type S (derived from ThreadSlot) per live thread.
+ *
+ * A thread claims a slot on first use and hands it back when it exits; a
+ * later thread may claim it again and keeps adding to it, so totals never
+ * lose a finished thread. Only the owner writes a slot, with plain relaxed
+ * loads and stores, and for_each() reads every slot with relaxed loads, so
+ * neither side takes a lock. Threads beyond MAX_SLOTS share one more slot,
+ * updated with atomic adds.
+ */
+template <typename S>
+class PerThread {
+public:
+  static constexpr size_t MAX_SLOTS = 256;
+
+  static S& local() {
+    thread_local Local l;
+    return *l.slot;
+  }
+
+  template <typename F>
+  static void for_each(F f) {
+    for (size_t i = 0; i < MAX_SLOTS; ++i) {
+      S* s = _slots[i].load(std::memory_order_acquire);
+      if (s) f(*s);
+    }
+    f(_overflow);
+  }
+
+private:
+  struct Local {
+    S* slot;
+
+    Local() : slot(claim()) {}
+    ~Local() {
+      if (!slot->shared) slot->owned.store(false, std::memory_order_release);
+    }
+  };
+
+  static S* claim() {
+    for (size_t i = 0; i < MAX_SLOTS; ++i) {
+      S* s = _slots[i].load(std::memory_order_acquire);
+      if (!s) {
+        S* fresh = new S();
+        if (_slots[i].compare_exchange_strong(s, fresh, std::memory_order_acq_rel)) s = fresh;
+        else delete fresh;
+      }
+      if (!s->owned.exchange(true, std::memory_order_acquire)) return s;
+    }
+    return &_overflow;
+  }
+
+  static inline std::array<std::atomic<S*>, MAX_SLOTS> _slots{};
+  static inline S _overflow{true};
+};
+
+/**
+ * @brief Counts of nonnegative integers binned by their top three bits.
+ *
+ * Four buckets per power of two, so a percentile is off by at most 1/8 of
+ * its value (and exact below 8). Written by one thread through a slot, see
+ * ThreadSlot; totals are summed into a Histogram::Total.
+ */
+class Histogram {
+public:
+  static constexpr size_t BUCKETS = 252;
+
+  void add(ThreadSlot& slot, uint64_t v) {
+    slot.bump(_counts[bucket(v)], 1);
+    slot.bump(_sum, v);
+    uint64_t m = _max.load(std::memory_order_relaxed);
+    while (v > m && !_max.compare_exchange_weak(m, v, std::memory_order_relaxed)) {}
+  }
+
+  void clear() {
+    for (auto& c : _counts) c.store(0, std::memory_order_relaxed);
+    _sum.store(0, std::memory_order_relaxed);
+    _max.store(0, std::memory_order_relaxed);
+  }
+
+  struct Total {
+    std::array<uint64_t, BUCKETS> counts{};
+    uint64_t sum = 0, max = 0;
+
+    void merge(const Histogram& h) {
+      for (size_t b = 0; b < BUCKETS; ++b) counts[b] += h._counts[b].load(std::memory_order_relaxed);
+      sum += h._sum.load(std::memory_order_relaxed);
+      max = std::max(max, h._max.load(std::memory_order_relaxed));
+    }
+
+    uint64_t count() const {
+      uint64_t n = 0;
+      for (uint64_t c : counts) n += c;
+      return n;
+    }
+
+    // the middle of the bucket holding the q-quantile, at most max
+    double percentile(double q) const {
+      uint64_t n = count(), rank = n ? (uint64_t)(q * (n - 1)) : 0, seen = 0;
+      for (size_t b = 0; b < BUCKETS; ++b) {
+        seen += counts[b];
+        if (seen > rank) return std::min(middle(b), (double)max);
+      }
+      return max;
+    }
+
+    // {"count": .., "mean": .., "p50": .., "p90": .., "p99": .., "max": ..},
+    // values times scale; with buckets also "buckets": [[lowest value, count], ..]
+    // over the nonempty ones
+    std::string json(double scale = 1, bool buckets = false) const {
+      uint64_t n = count();
+      std::string s = "{\"count\": " + std::to_string(n) +
+                      ", \"mean\": " + number(n ? sum * scale / n : 0) +
+                      ", \"p50\": " + number(percentile(0.50) * scale) +
+                      ", \"p90\": " + number(percentile(0.90) * scale) +
+                      ", \"p99\": " + number(percentile(0.99) * scale) +
+                      ", \"max\": " + number(max * scale);
+      if (buckets) {
+        s += ", \"buckets\": [";
+        bool first = true;
+        for (size_t b = 0; b < BUCKETS; ++b) {
+          if (!counts[b]) continue;
+          s += std::string(first ? "" : ", ") + "[" + std::to_string(lowest(b)) + ", " + std::to_string(counts[b]) + "]";
+          first = false;
+        }
+        s += "]";
+      }
+      return s + "}";
+    }
+  };
+
+  static size_t bucket(uint64_t v) {
+    if (v < 4) return v;
+    size_t e = 63 - __builtin_clzll(v);
+    return (e - 1) * 4 + ((v >> (e - 2)) & 3);
+  }
+
+  static uint64_t lowest(size_t b) {
+    if (b < 4) return b;
+    size_t e = b / 4 + 1;
+    return (4 + b % 4) << (e - 2);
+  }
+
+  static double middle(size_t b) {
+    if (b < 4) return b;
+    double width = (double)(1ull << (b / 4 - 1));
+    return lowest(b) + (width - 1) / 2;
+  }
+
+  static std::string number(double x) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.9g", x);
+    return buf;
+  }
+
+private:
+  std::array<std::atomic<uint64_t>, BUCKETS> _counts{};
+  std::atomic<uint64_t> _sum{0}, _max{0};
+};
+
+/**
+ * @brief Counters, sums and latency histograms of the query path.
+ *
+ * Latencies are kept in nanoseconds and reported in seconds, one histogram
+ * per phase, which Timer feeds with the TIMER ids.
+ */
+class Metrics {
+public:
+  static constexpr size_t MAX_PHASES = 16;
+
+  static void add(COUNTER c, uint64_t n) {
+    Slot& s = PerThread<Slot>::local();
+    s.bump(s.counters[(size_t)c], n);
+  }
+
+  static void add(SUM c, double x) {
+    Slot& s = PerThread<Slot>::local();
+    s.bump(s.sums[(size_t)c], x);
+  }
+
+  static void latency(size_t phase, double seconds) {
+    Slot& s = PerThread<Slot>::local();
+    s.latency[phase].add(s, seconds > 0 ? (uint64_t)(seconds * 1e9) : 0);
+  }
+
+  // zero every slot, with no metric in flight
+  static void reset() {
+#ifdef METRICS
+    PerThread<Slot>::for_each([](Slot& s) { s.clear(); });
+#endif
+  }
+
+  // {"enabled": .., "counters": {..}, "sums": {..}, "latency": {"<phase>": {..}, ..}}
+  // with the latencies (see Histogram::Total::json) in seconds, for the
+  // phases with at least one sample
+  static std::string json(const char* const* phase_names, size_t num_phases) {
+    static const char* counter_names[] = {"queries", "pushes", "edges_scanned", "refine_nodes", "refine_components"};
+    static const char* sum_names[] = {"residue_left"};
+    static_assert(sizeof(counter_names) / sizeof(*counter_names) == (size_t)COUNTER::_);
+    static_assert(sizeof(sum_names) / sizeof(*sum_names) == (size_t)SUM::_);
+
+    std::array<uint64_t, (size_t)COUNTER::_> counters{};
+    std::array<double, (size_t)SUM::_> sums{};
+    std::array<Histogram::Total, MAX_PHASES> latency{};
+#ifdef METRICS
+    PerThread<Slot>::for_each([&](Slot& s) {
+      for (size_t c = 0; c < counters.size(); ++c) counters[c] += s.counters[c].load(std::memory_order_relaxed);
+      for (size_t c = 0; c < sums.size(); ++c) sums[c] += s.sums[c].load(std::memory_order_relaxed);
+      for (size_t p = 0; p < MAX_PHASES; ++p) latency[p].merge(s.latency[p]);
+    });
+    std::string ret = "{\"enabled\": true, \"counters\": {";
+#else
+    std::string ret = "{\"enabled\": false, \"counters\": {";
+#endif
+    for (size_t c = 0; c < counters.size(); ++c)
+      ret += std::string(c ? ", " : "") + "\"" + counter_names[c] + "\": " + std::to_string(counters[c]);
+    ret += "}, \"sums\": {";
+    for (size_t c = 0; c < sums.size(); ++c)
+      ret += std::string(c ? ", " : "") + "\"" + sum_names[c] + "\": " + Histogram::number(sums[c]);
+    ret += "}, \"latency\": {";
+    bool first = true;
+    for (size_t p = 0; p < std::min(num_phases, MAX_PHASES); ++p) {
+      if (latency[p].count() == 0) continue;
+      ret += std::string(first ? "" : ", ") + "\"" + phase_names[p] + "\": " + latency[p].json(1e-9);
+      first = false;
+    }
+    return ret + "}}";
+  }
+
+private:
+  struct Slot : ThreadSlot {
+    using ThreadSlot::ThreadSlot;
+
+    std::array<std::atomic<uint64_t>, (size_t)COUNTER::_> counters{};
+    std::array<std::atomic<double>, (size_t)SUM::_> sums{};
+    std::array<Histogram, MAX_PHASES> latency{};
+
+    void clear() {
+      for (auto& c : counters) c.store(0, std::memory_order_relaxed);
+      for (auto& c : sums) c.store(0, std::memory_order_relaxed);
+      for (auto& h : latency) h.clear();
+    }
+  };
+};
+
+#ifdef METRICS
+#define metric_add(what, n) Metrics::add(what, n)
+#define metric_latency(phase, seconds) Metrics::latency(phase, seconds)
+#else
+#define metric_add(what, n) ((void)0)
+#define metric_latency(phase, seconds) ((void)0)
+#endif
@@ -0,0 +1,201 @@
+#pragma once
+
+#include "time/metrics.hpp"
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <mutex>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+// Hardware counters over timed phases, through perf_event_open. They are
+// compiled in with -DPERF_COUNTERS (make PERF_COUNTERS=-DPERF_COUNTERS);
+// without it Timer reads no counter at all.
+
+enum struct PERF : size_t {
+  CYCLES, INSTRUCTIONS, LLC_MISSES, BRANCH_MISSES, _
+};
+
+/**
+ * @brief Cycles, instructions, last-level cache misses and branch misses
+ * per phase.
+ *
+ * Every thread opens its own counters, for user space only, on its first
+ * read() or attach(); the long-lived workers of WorkerPool and RepairPool
+ * attach when they start. A read sums the counters of all threads opened so
+ * far (each scaled up when the kernel multiplexed it), those that exited
+ * included, so a phase opened on the caller thread also counts the work its
+ * workers do while it is open, and background repairs that overlap it. A
+ * phase adds the difference between the reads at its start and end into
+ * the per-thread slot of the thread that opened it, like Metrics.
+ * Where the counters cannot be opened (no PMU in a VM, or
+ * perf_event_paranoid too high) reads are invalid and nothing is counted;
+ * json() says why.
+ */
+class PerfCounters {
+public:
+  static constexpr size_t MAX_PHASES = 16;
+
+  struct Reading {
+    std::array<uint64_t, (size_t)PERF::_> values{};
+    bool valid = false;
+  };
+
+  static Reading read() {
+    Reading r;
+    if (!events().open) return r;
+    std::lock_guard<std::mutex> lk(_mutex);
+    r.values = _exited;
+    for (Events* e : _threads)
+      if (!e->add_to(r.values)) return Reading{};
+    r.valid = true;
+    return r;
+  }
+
+  // open the counters of this thread, so that reads on other threads count
+  // its work from here on
+  static void attach() {
+#ifdef PERF_COUNTERS
+    events();
+#endif
+  }
+
+  // count the events since start into phase
+  static void add(size_t phase, const Reading& start) {
+    if (!start.valid) return;
+    Reading end = read();
+    if (!end.valid) return;
+    Slot& s = PerThread<Slot>::local();
+    for (size_t i = 0; i < (size_t)PERF::_; ++i)
+      s.bump(s.values[phase][i], end.values[i] - std::min(start.values[i], end.values[i]));
+    s.bump(s.count[phase], 1);
+  }
+
+  static void reset() {
+#ifdef PERF_COUNTERS
+    PerThread<Slot>::for_each([](Slot& s) {
+      for (auto& p : s.values)
+        for (auto& v : p) v.store(0, std::memory_order_relaxed);
+      for (auto& c : s.count) c.store(0, std::memory_order_relaxed);
+    });
+#endif
+  }
+
+  // {"enabled": .., "available": .., "error": "..", "phases": {"<phase>":
+  //  {"count": .., "cycles": .., "instructions": .., "llc_misses": ..,
+  //   "branch_misses": .., "ipc": .., "llc_misses_per_kinst": ..,
+  //   "branch_misses_per_kinst": ..}, ..}}
+  // for the phases counted at least once; error is there only when the
+  // counters could not be opened
+  static std::string json(const char* const* phase_names, size_t num_phases) {
+    static const char* names[] = {"cycles", "instructions", "llc_misses", "branch_misses"};
+    static_assert(sizeof(names) / sizeof(*names) == (size_t)PERF::_);
+
+    std::array<std::array<uint64_t, (size_t)PERF::_>, MAX_PHASES> values{};
+    std::array<uint64_t, MAX_PHASES> count{};
+#ifdef PERF_COUNTERS
+    PerThread<Slot>::for_each([&](Slot& s) {
+      for (size_t p = 0; p < MAX_PHASES; ++p) {
+        for (size_t i = 0; i < (size_t)PERF::_; ++i) values[p][i] += s.values[p][i].load(std::memory_order_relaxed);
+        count[p] += s.count[p].load(std::memory_order_relaxed);
+      }
+    });
+    int error = _error.load(std::memory_order_relaxed);
+    std::string ret = std::string("{\"enabled\": true, \"available\": ") + (events().open ? "true" : "false");
+    if (error) ret += std::string(", \"error\": \"") + strerror(error) + "\"";
+#else
+    std::string ret = "{\"enabled\": false, \"available\": false";
+#endif
+    ret += ", \"phases\": {";
+    bool first = true;
+    for (size_t p = 0; p < std::min(num_phases, MAX_PHASES); ++p) {
+      if (count[p] == 0) continue;
+      auto& v = values[p];
+      double kinst = v[(size_t)PERF::INSTRUCTIONS] / 1e3;
+      ret += std::string(first ? "" : ", ") + "\"" + phase_names[p] + "\": {\"count\": " + std::to_string(count[p]);
+      for (size_t i = 0; i < (size_t)PERF::_; ++i) ret += std::string(", \"") + names[i] + "\": " + std::to_string(v[i]);
+      ret += ", \"ipc\": " + Histogram::number(v[(size_t)PERF::CYCLES] ? (double)v[(size_t)PERF::INSTRUCTIONS] / v[(size_t)PERF::CYCLES] : 0) +
+             ", \"llc_misses_per_kinst\": " + Histogram::number(kinst ? v[(size_t)PERF::LLC_MISSES] / kinst : 0) +
+             ", \"branch_misses_per_kinst\": " + Histogram::number(kinst ? v[(size_t)PERF::BRANCH_MISSES] / kinst : 0) + "}";
+      first = false;
+    }
+    return ret + "}}";
+  }
+
+private:
+  // the counters of one thread, listed in _threads while it runs; on exit
+  // their last values move to _exited
+  struct Events {
+    std::array<int, (size_t)PERF::_> fds;
+    bool open = true;
+
+    Events() {
+      static const uint64_t configs[] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                         PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+      fds.fill(-1);
+      for (size_t i = 0; i < (size_t)PERF::_; ++i) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds[i] < 0) {
+          _error.store(errno, std::memory_order_relaxed);
+          open = false;
+          break;
+        }
+      }
+      if (open) {
+        std::lock_guard<std::mutex> lk(_mutex);
+        _threads.push_back(this);
+      }
+    }
+
+    ~Events() {
+      if (open) {
+        std::lock_guard<std::mutex> lk(_mutex);
+        add_to(_exited);
+        _threads.erase(std::find(_threads.begin(), _threads.end(), this));
+      }
+      for (int fd : fds)
+        if (fd >= 0) close(fd);
+    }
+
+    // add the current counts to values, false if a counter cannot be read
+    bool add_to(std::array<uint64_t, (size_t)PERF::_>& values) const {
+      for (size_t i = 0; i < (size_t)PERF::_; ++i) {
+        uint64_t v[3];  // value, time enabled, time running
+        if (::read(fds[i], v, sizeof(v)) != sizeof(v)) return false;
+        values[i] += v[2] ? (uint64_t)((double)v[0] * v[1] / v[2]) : 0;
+      }
+      return true;
+    }
+  };
+
+  static Events& events() {
+    thread_local Events e;
+    return e;
+  }
+
+  struct Slot : ThreadSlot {
+    using ThreadSlot::ThreadSlot;
+
+    std::array<std::array<std::atomic<uint64_t>, (size_t)PERF::_>, MAX_PHASES> values{};
+    std::array<std::atomic<uint64_t>, MAX_PHASES> count{};
+  };
+
+  static inline std::atomic<int> _error{0};
+  static inline std::mutex _mutex;  // guards the two below
+  static inline std::vector<Events*> _threads;
+  static inline std::array<uint64_t, (size_t)PERF::_> _exited{};
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "time/metrics.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Structural telemetry of the StackIndex build and update paths, compiled
+// in with -DTELEMETRY (make TELEMETRY=-DTELEMETRY); otherwise every
+// telemetry_* macro is (0) and its arguments are never evaluated.
+
+enum struct HIST : size_t {
+  TREES_AFFECTED,    // per update, trees whose stacks it changed
+  REWALKED_STEPS,    // per tree repair, stack entries read or drawn
+  REWALKED_DRAWS,    // per tree repair, entries drawn afresh
+  LOOP_ERASED,       // per tree built or repaired, walk steps erased by loops
+  COMPONENT_SIZE,    // per component of a tree built or repaired
+  _
+};
+
+/**
+ * @brief Histograms of what StackIndex updates cost structurally.
+ *
+ * Besides the HIST ones, the stack depth (top) of every node of a tree
+ * built or repaired is kept per degree bucket, floor(log2(degree)), so
+ * the depth distribution shows how far walks get at each degree. Kept per
+ * thread like Metrics, since trees are repaired on several threads.
+ */
+class Telemetry {
+public:
+  static constexpr size_t DEGREE_BUCKETS = 33;
+
+  static void add(HIST h, uint64_t v) {
+    Slot& s = PerThread<Slot>::local();
+    s.hists[(size_t)h].add(s, v);
+  }
+
+  static void depth(uint64_t degree, uint64_t top) {
+    Slot& s = PerThread<Slot>::local();
+    s.depths[degree_bucket(degree)].add(s, top);
+  }
+
+  static size_t degree_bucket(uint64_t degree) {
+    return degree ? 63 - __builtin_clzll(degree) : 0;
+  }
+
+  static void reset() {
+#ifdef TELEMETRY
+    PerThread<Slot>::for_each([](Slot& s) {
+      for (auto& h : s.hists) h.clear();
+      for (auto& h : s.depths) h.clear();
+    });
+#endif
+  }
+
+  // {"enabled": .., "<hist>": {..}, .., "stack_depth": {"<lowest degree>": {..}, ..}}
+  // with every histogram as in Histogram::Total::json, buckets included;
+  // empty degree buckets are left out
+  static std::string json() {
+    static const char* names[] = {"trees_affected", "rewalked_steps", "rewalked_draws", "loop_erased", "component_size"};
+    static_assert(sizeof(names) / sizeof(*names) == (size_t)HIST::_);
+
+    std::array<Histogram::Total, (size_t)HIST::_> hists{};
+    std::array<Histogram::Total, DEGREE_BUCKETS> depths{};
+#ifdef TELEMETRY
+    PerThread<Slot>::for_each([&](Slot& s) {
+      for (size_t h = 0; h < hists.size(); ++h) hists[h].merge(s.hists[h]);
+      for (size_t d = 0; d < depths.size(); ++d) depths[d].merge(s.depths[d]);
+    });
+    std::string ret = "{\"enabled\": true";
+#else
+    std::string ret = "{\"enabled\": false";
+#endif
+    for (size_t h = 0; h < hists.size(); ++h)
+      ret += std::string(", \"") + names[h] + "\": " + hists[h].json(1, true);
+    ret += ", \"stack_depth\": {";
+    bool first = true;
+    for (size_t d = 0; d < depths.size(); ++d) {
+      if (depths[d].count() == 0) continue;
+      ret += std::string(first ? "" : ", ") + "\"" + std::to_string(1ull << d) + "\": " + depths[d].json(1, true);
+      first = false;
+    }
+    return ret + "}}";
+  }
+
+private:
+  struct Slot : ThreadSlot {
+    using ThreadSlot::ThreadSlot;
+
+    std::array<Histogram, (size_t)HIST::_> hists{};
+    std::array<Histogram, DEGREE_BUCKETS> depths{};
+  };
+};
+
+#ifdef TELEMETRY
+#define telemetry_add(hist, v) Telemetry::add(hist, v)
+#define telemetry_depth(degree, top) Telemetry::depth(degree, top)
+#else
+#define telemetry_add(hist, v) ((void)0)
+#define telemetry_depth(degree, top) ((void)0)
+#endif
@@ -2,9 +2,13 @@
 
 #include <array>
 #include <chrono>
+#include <string>
+#include "time/metrics.hpp"
+#include "time/perf_counters.hpp"
+#include "time/trace.hpp"
 
 enum struct TIMER : size_t {
-  UPDATE, EVALUATE, PUSH, ADAPT, REFINE, BUILD, OUTPUT, _
+  UPDATE, EVALUATE, PUSH, ADAPT, REFINE, BUILD, OUTPUT, REPAIR, _
 };
 
 class Timer {
@@ -12,6 +16,10 @@ private:
   static std::array<double, (size_t)TIMER::_> timers;
 
 public:
+  static constexpr const char* names[(size_t)TIMER::_] = {
+    "update", "evaluate", "push", "adapt", "refine", "build", "output", "repair"
+  };
+
   static double used(TIMER timer) {
     return timers[(size_t)timer];
   }
@@ -24,21 +32,50 @@ public:
     for (size_t id = 0; id < (size_t)TIMER::_; ++id) timers[id] = 0;
   }
 
+  // the metrics so far, with a latency histogram per timer, see time/metrics.hpp
+  static std::string metrics_json() {
+    static_assert((size_t)TIMER::_ <= Metrics::MAX_PHASES);
+    return Metrics::json(names, (size_t)TIMER::_);
+  }
+
+  // the hardware counters of the counted timers, see time/perf_counters.hpp
+  static std::string perf_json() {
+    static_assert((size_t)TIMER::_ <= PerfCounters::MAX_PHASES);
+    return PerfCounters::json(names, (size_t)TIMER::_);
+  }
+
+  // the timers with hardware counters; the others stay free of their reads
+  static constexpr bool counted(TIMER timer) {
+    return timer == TIMER::PUSH || timer == TIMER::REFINE || timer == TIMER::UPDATE || timer == TIMER::BUILD;
+  }
+
 private:
   using clock = std::chrono::steady_clock;
   using duration = std::chrono::duration<double>;
 
   const size_t _timer_id;
+#ifdef PERF_COUNTERS
+  const PerfCounters::Reading _counters;
+#endif
   const clock::time_point _setup_time;
 
 public:
   Timer(TIMER timer) :
       _timer_id((size_t)timer),
+#ifdef PERF_COUNTERS
+      _counters(counted(timer) ? PerfCounters::read() : PerfCounters::Reading{}),
+#endif
       _setup_time(clock::steady_clock::now()) { }
 
   ~Timer() {
-    timers[_timer_id] +=
-      std::chrono::duration_cast<duration>(clock::now() - _setup_time).count();
+    clock::time_point end = clock::now();
+    double t = std::chrono::duration_cast<duration>(end - _setup_time).count();
+    timers[_timer_id] += t;
+    if (Trace::on()) Trace::complete(names[_timer_id], "timer", _setup_time, end);
+    metric_latency(_timer_id, t);
+#ifdef PERF_COUNTERS
+    PerfCounters::add(_timer_id, _counters);
+#endif
   }
 };
 
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "time/metrics.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Timeline of the timed phases, updates and tree repairs, written in
+ * the Chrome trace-event format (chrome://tracing, Perfetto).
+ *
+ * Off until start(); while off, a span costs one load of a flag. Every thread
+ * appends its complete ("X") events to its own buffer, a PerThread slot, so
+ * recording takes no lock, and write() merges the buffers once no event is
+ * in flight. A thread that claims a slot a finished one handed back goes on
+ * in the same lane (tid).
+ */
+class Trace {
+public:
+  using clock = std::chrono::steady_clock;
+
+  // unused ones have no name
+  struct Arg {
+    const char* name;
+    int64_t value;
+  };
+  static constexpr size_t MAX_ARGS = 3;
+
+  static void start() {
+    _start = clock::now();
+    _on.store(true, std::memory_order_release);
+  }
+
+  static bool on() {
+    return _on.load(std::memory_order_acquire);
+  }
+
+  // name and cat must outlive the trace, e.g. string literals
+  static void complete(const char* name, const char* cat, clock::time_point begin, clock::time_point end,
+                       const std::array<Arg, MAX_ARGS>& args = {}) {
+    Slot& s = PerThread<Slot>::local();
+    s.events.push_back({name, cat, micros(begin), micros(end) - micros(begin), args});
+  }
+
+  // stop and write every event to path, {"traceEvents": [..]}; false if
+  // path cannot be written
+  static bool write(const std::string& path) {
+    _on.store(false, std::memory_order_release);
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) return false;
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    PerThread<Slot>::for_each([&](Slot& s) {
+      for (auto& e : s.events) {
+        fprintf(f, "%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %zu",
+                first ? "" : ",\n", e.name, e.cat, e.ts, e.dur, s.tid);
+        if (e.args[0].name) {
+          fprintf(f, ", \"args\": {");
+          for (size_t i = 0; i < MAX_ARGS && e.args[i].name; ++i)
+            fprintf(f, "%s\"%s\": %lld", i ? ", " : "", e.args[i].name, (long long)e.args[i].value);
+          fprintf(f, "}");
+        }
+        fprintf(f, "}");
+        first = false;
+      }
+      s.events.clear();
+      s.events.shrink_to_fit();
+    });
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0;
+  }
+
+private:
+  struct Event {
+    const char* name;
+    const char* cat;
+    double ts, dur;  // microseconds
+    std::array<Arg, MAX_ARGS> args;
+  };
+
+  struct Slot : ThreadSlot {
+    std::vector<Event> events;
+    const size_t tid;
+
+    explicit Slot(bool shared = false) : ThreadSlot(shared), tid(_lanes.fetch_add(1, std::memory_order_relaxed)) {}
+  };
+
+  static double micros(clock::time_point t) {
+    return std::chrono::duration<double, std::micro>(t - _start).count();
+  }
+
+  static inline std::atomic<bool> _on{false};
+  static inline clock::time_point _start;
+  static inline std::atomic<size_t> _lanes{0};
+};
+
+// One complete event from construction to destruction, when the trace is on.
+class TraceSpan {
+public:
+  TraceSpan(const char* name, const char* cat) : _name(name), _cat(cat), _on(Trace::on()) {
+    if (_on) _begin = Trace::clock::now();
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  // up to Trace::MAX_ARGS, the rest are dropped
+  void arg(const char* name, int64_t value) {
+    if (_on && _num_args < Trace::MAX_ARGS) _args[_num_args++] = {name, value};
+  }
+
+  ~TraceSpan() {
+    if (_on) Trace::complete(_name, _cat, _begin, Trace::clock::now(), _args);
+  }
+
+private:
+  const char* _name;
+  const char* _cat;
+  const bool _on;
+  Trace::clock::time_point _begin;
+  std::array<Trace::Arg, Trace::MAX_ARGS> _args{};
+  size_t _num_args = 0;
+};
@@ -40,6 +40,7 @@ private:
     path& operator =(const path&) = delete;
 
     path_leng leng() const noexcept { return _recs.size() - 1; }
+    size_t bytes() const noexcept { return _recs.capacity() * sizeof(record); }
     record& operator[](path_leng i) { return _recs[i]; }
     const record& operator[](path_leng i) const { return _recs[i]; }
   };
@@ -82,6 +83,16 @@ private:
       std::destroy_at(&_data[id]);
       _inact.insert(id);
     }
+
+    void add_usage(MemoryUsage& usage) const {
+      size_t bytes = _data.capacity() * sizeof(path) + hash_bytes(_inact), active = 0;
+      for (path_id id = 1; id < _data.size(); ++id) {
+        if (!is_active(id)) continue;
+        bytes += _data[id].bytes();
+        ++active;
+      }
+      usage.add("paths", bytes, active);
+    }
   } _paths;
 
   class {
@@ -106,6 +117,7 @@ private:
     auto end() noexcept { return _data.end(); }
     auto end() const noexcept { return _data.end(); }
     void clear() { _data.clear(); }
+    size_t bytes() const { return hash_bytes(_data); }
   } __update_list;
 
   void _hit_node(path_id wid, path_leng wstep, node_id v) {
@@ -243,7 +255,7 @@ private:
 
 public:
   template <typename C>
-  windex_inc(graph* g, bool is_dird, C config) :
+  windex_inc(graph* g, bool is_dird, C& config) :
     _walks(g->num_nodes() + 1),
     _tpoints(g->num_nodes() + 1),
     _n_act_edges(g->num_nodes() + 1),
@@ -264,6 +276,45 @@ public:
   template <typename Vec>
   void adapt(const Vec&, double) { }
 
+  MemoryUsage memory_usage() const {
+    MemoryUsage usage;
+    size_t walks = _walks.capacity() * sizeof(std::vector<path_id>), n_walks = 0;
+    for (auto& w : _walks) {
+      walks += w.capacity() * sizeof(path_id);
+      n_walks += w.size();
+    }
+    usage.add("walks", walks, n_walks);
+    size_t tpoints = _tpoints.capacity() * sizeof(std::vector<node_id>), n_tpoints = 0;
+    for (auto& t : _tpoints) {
+      tpoints += t.capacity() * sizeof(node_id);
+      n_tpoints += t.size();
+    }
+    usage.add("tpoints", tpoints, n_tpoints);
+    usage.add("counters", _n_act_edges.capacity() * sizeof(edge_sno) + _n_node_recs.capacity() * sizeof(record_sno),
+              _n_act_edges.size() + _n_node_recs.size());
+    auto record_bytes = [](const records& r) {
+      return r.wid.capacity() * sizeof(path_id) + r.wstep.capacity() * sizeof(path_leng);
+    };
+    size_t node_recs = _node_recs.capacity() * sizeof(records), n_node_recs = 0;
+    for (auto& r : _node_recs) {
+      node_recs += record_bytes(r);
+      n_node_recs += r.size();
+    }
+    usage.add("node_records", node_recs, n_node_recs);
+    size_t edge_recs = _edge_recs.capacity() * sizeof(scarray<records>), n_edge_recs = 0;
+    for (auto& e : _edge_recs) {
+      edge_recs += e.capacity() * sizeof(records);
+      for (auto& r : e) {
+        edge_recs += record_bytes(r);
+        n_edge_recs += r.size();
+      }
+    }
+    usage.add("edge_records", edge_recs, n_edge_recs);
+    _paths.add_usage(usage);
+    usage.add("update_list", __update_list.bytes(), __update_list.size());
+    return usage;
+  }
+
   node_id get(node_id s, record_sno wsno) const {
     return _tpoints[s][wsno];
   }
@@ -0,0 +1,96 @@
+#include "Index-stackindex.hpp"
+#include "fora_skeleton.hpp"
+#include "graph.hpp"
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+// The estimate an index refines from a unit residue is a distribution over
+// the nodes, so it sums to one from every source. This checks that it still
+// does after each of a run of random edge inserts and deletes, for the
+// indexes that serve updates. Run with make test; exits nonzero on failure.
+
+size_t failures = 0;
+
+// a graph on n nodes with a cycle through all of them, so that none starts
+// dangling, and m more random edges
+graph *random_graph(node_id n, size_t m, bool directed, std::mt19937 &rng) {
+    graph *G = new graph(n);
+    auto add = [&](node_id u, node_id v) {
+        G->insert_edge(u, v);
+        if (!directed) G->insert_edge(v, u);
+    };
+    for (node_id u = 0; u < n; u++) add(u, (u + 1) % n);
+    for (size_t i = 0; i < m; i++) {
+        node_id u = rng() % n, v = rng() % n;
+        if (u != v) add(u, v);
+    }
+    return G;
+}
+
+bool sums_to_one(IndexMethod<Config> &I, graph *G, const std::string &name, size_t op) {
+    node_id n = G->num_nodes();
+    for (node_id s = 0; s < n; s++) {
+        std::vector<double> rsv(n, 0), rsd(n, 0);
+        rsd[s] = 1;
+        I.refine(rsv, rsd);
+        double sum = 0;
+        for (double x : rsv) sum += x;
+        if (std::abs(sum - 1) > 1e-9) {
+            printf("FAIL %s: after %zu updates the estimate from %zu sums to %.12f\n", name.c_str(), op, (size_t)s, sum);
+            failures++;
+            return false;
+        }
+    }
+    return true;
+}
+
+// random inserts and deletes, some of which leave nodes dangling
+void churn(const std::string &name, bool directed, std::function<IndexMethod<Config> *(graph *, Config *)> make,
+           std::function<void(Config &)> setup = [](Config &) {}) {
+    std::mt19937 rng(7);
+    graph *G = random_graph(40, 80, directed, rng);
+    Config C(directed, 0.2, 0.5, 0.1, 0.01, 0.1);
+    setup(C);
+    IndexMethod<Config> *I = make(G, &C);
+    FORA<Config> f;
+    bool ok = sums_to_one(*I, G, name, 0);
+    for (size_t op = 1; ok && op <= 200; op++) {
+        node_id u = rng() % G->num_nodes();
+        if (rng() % 2 || G->is_dangling_node(u)) {
+            node_id v = rng() % G->num_nodes();
+            if (u != v) f.insert_edge(u, v, I);
+        } else {
+            f.delete_edge(u, G->get_neighbour(u, rng() % G->get_degree(u)), I);
+        }
+        ok = sums_to_one(*I, G, name, op);
+    }
+    printf("%s %s\n", ok ? "ok  " : "FAIL", name.c_str());
+    delete I;
+    delete G;
+}
+
+int main() {
+    auto stackindex = [](graph *G, Config *C) -> IndexMethod<Config> * { return new StackIndex(G, C); };
+    auto stackindex_keyed = [](graph *G, Config *C) -> IndexMethod<Config> * { return new StackIndex_Keyed(G, C); };
+    auto stackindex_static = [](graph *G, Config *C) -> IndexMethod<Config> * { return new StackIndex_Static(G, C); };
+    auto stackindex_multi_alpha = [](graph *G, Config *C) -> IndexMethod<Config> * {
+        return new StackIndex_MultiAlpha(G, C, {0.1, C->alpha});
+    };
+
+    for (bool directed : {true, false}) {
+        std::string kind = directed ? " directed" : " undirected";
+        churn("stackindex" + kind, directed, stackindex);
+        churn("stackindex unfused" + kind, directed, stackindex, [](Config &C) { C.fuse_undirected = false; });
+        churn("stackindex lazy" + kind, directed, stackindex, [](Config &C) { C.lazy_repair = true; });
+        churn("stackindex repair threads" + kind, directed, stackindex, [](Config &C) { C.repair_threads = 2; });
+        churn("stackindex threads" + kind, directed, stackindex, [](Config &C) { C.num_threads = 2; });
+        churn("stackindex_keyed" + kind, directed, stackindex_keyed);
+        churn("stackindex_static" + kind, directed, stackindex_static);
+        churn("stackindex_multi_alpha" + kind, directed, stackindex_multi_alpha);
+    }
+    return failures != 0;
+}
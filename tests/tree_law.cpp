@@ -0,0 +1,186 @@
+#include "Index-stackindex.hpp"
+#include "fora_skeleton.hpp"
+#include "graph.hpp"
+#include "lib/random.hpp"
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// An update has to leave the trees of an index distributed as a fresh build
+// on the new graph would draw them. Sums of estimates (estimate_sum) cannot
+// tell, since every forest gives a distribution, so this counts over all
+// trees how often each node points to each neighbour (next) and how often it
+// lies in the tree of each root, after inserts, deletes and alpha updates,
+// and compares them with a fresh build on a small graph, within 5 standard
+// deviations. Run with make test; exits nonzero on failure.
+
+size_t failures = 0;
+
+using edge = std::pair<node_id, node_id>;
+
+// the directed edges of the graph, both directions added when undirected;
+// scenarios leave no node but 0 dangling, which a StackIndex build expects
+const std::vector<edge> base_edges = {{0, 1}, {1, 2}, {2, 0}, {2, 3}, {3, 4}, {4, 5}, {5, 3}, {1, 4}};
+const node_id num_nodes = 6;
+
+graph *make_graph(const std::vector<edge> &edges, bool directed) {
+    graph *G = new graph(num_nodes);
+    for (auto [u, v] : edges) {
+        G->insert_edge(u, v);
+        if (!directed) G->insert_edge(v, u);
+    }
+    return G;
+}
+
+struct Update {
+    char op;  // '+' insert, '-' delete, 'a' alpha
+    node_id u, v;
+    double alpha;
+};
+
+// frequencies over the trees: next[u * (n + 1) + v] that u points to v (v = n
+// for a root), root[u * n + r] that u lies in the tree of r
+struct Law {
+    std::vector<double> next, root;
+    size_t num_trees = 0;
+};
+
+Law law_of(StackIndex &I, graph *G) {
+    I.repair();
+    node_id n = G->num_nodes();
+    Law law;
+    law.next.assign(n * (n + 1), 0);
+    law.root.assign(n * n, 0);
+    for (auto &stacktree : I.stack_index._index) {
+        for (node_id u = 0; u < n; u++) {
+            auto &s = stacktree[u];
+            uint32_t k = s.top ? s[s.top - 1] : StackIndex::Stack::NONE;
+            node_id v = k == StackIndex::Stack::NONE || G->is_dangling_node(u) ? n : G->get_neighbour(u, k);
+            law.next[u * (n + 1) + v]++;
+            law.root[u * n + stacktree.components.root(u)]++;
+        }
+    }
+    law.num_trees = I.stack_index._index.size();
+    return law;
+}
+
+Law law_of(StackIndex_Keyed &I, graph *G) {
+    node_id n = G->num_nodes();
+    Law law;
+    law.next.assign(n * (n + 1), 0);
+    law.root.assign(n * n, 0);
+    for (size_t t = 0; t < I.stack_index.size(); t++) {
+        for (node_id u = 0; u < n; u++) {
+            node_id v = I.next(t, u);
+            law.next[u * (n + 1) + (v == (node_id)-1 ? n : v)]++;
+            law.root[u * n + I.root(t, u)]++;
+        }
+    }
+    law.num_trees = I.stack_index.size();
+    return law;
+}
+
+// each frequency of a against b (drawn independently), within 5 pooled
+// standard deviations
+bool same_law(const std::vector<double> &a, size_t na, const std::vector<double> &b, size_t nb, const char *what,
+              const std::string &name) {
+    for (size_t i = 0; i < a.size(); i++) {
+        double p = (a[i] + b[i]) / (na + nb);
+        double sd = std::sqrt(p * (1 - p) * (1.0 / na + 1.0 / nb));
+        double d = std::abs(a[i] / na - b[i] / nb);
+        if (d > 5 * sd + 1e-12) {
+            printf("FAIL %s: %s entry %zu at %.4f, fresh build at %.4f\n", name.c_str(), what, i, a[i] / na, b[i] / nb);
+            return false;
+        }
+    }
+    return true;
+}
+
+// the law of a fresh StackIndex on each final graph, drawn once
+std::map<std::string, Law> fresh;
+
+template <class I>
+void check(const std::string &name, const std::string &scenario, bool directed, const std::vector<Update> &updates,
+           std::function<void(Config &)> setup = [](Config &) {},
+           std::function<void(I &)> before_update = [](I &) {}) {
+    Config C(directed, 0.2, 0.05, 0.1, 0.01, 1);
+    setup(C);
+    graph *G = make_graph(base_edges, directed);
+    I *index = new I(G, &C);
+    FORA<Config> f;
+    std::vector<edge> edges = base_edges;
+    double alpha = C.alpha;
+    for (auto &up : updates) {
+        before_update(*index);
+        if (up.op == '+') {
+            f.insert_edge(up.u, up.v, index);
+            edges.push_back({up.u, up.v});
+        } else if (up.op == '-') {
+            f.delete_edge(up.u, up.v, index);
+            for (auto &e : edges) {
+                if (e == edge{up.u, up.v}) {
+                    e = edges.back();
+                    edges.pop_back();
+                    break;
+                }
+            }
+        } else {
+            index->update_alpha(up.alpha);
+            alpha = up.alpha;
+        }
+    }
+    Law got = law_of(*index, G);
+
+    std::string key = scenario + (directed ? " directed" : " undirected");
+    if (!fresh.count(key)) {
+        Config D(directed, alpha, 0.05, 0.1, 0.01, 1);
+        graph *H = make_graph(edges, directed);
+        StackIndex J(H, &D);
+        fresh[key] = law_of(J, H);
+        delete H;
+    }
+    Law &want = fresh[key];
+
+    std::string tag = name + " " + key;
+    bool ok = same_law(got.root, got.num_trees, want.root, want.num_trees, "root", tag);
+    if (ok) ok = same_law(got.next, got.num_trees, want.next, want.num_trees, "next", tag);
+    if (!ok) failures++;
+    printf("%s %s\n", ok ? "ok  " : "FAIL", tag.c_str());
+    delete index;
+    delete G;
+}
+
+int main() {
+    rand_uint.seed(11);
+    std::vector<std::pair<std::string, std::vector<Update>>> scenarios = {
+        {"insert", {{'+', 0, 5, 0}}},
+        {"delete", {{'-', 1, 2, 0}}},
+        {"delete leaving a dangling node", {{'-', 0, 1, 0}}},
+        {"insert at a dangling node", {{'-', 0, 1, 0}, {'+', 0, 4, 0}}},
+        {"alpha", {{'a', 0, 0, 0.3}, {'a', 0, 0, 0.15}}},
+        {"mixed", {{'+', 0, 5, 0}, {'-', 1, 2, 0}, {'+', 3, 0, 0}, {'-', 3, 4, 0}, {'+', 1, 2, 0}, {'a', 0, 0, 0.25}}},
+    };
+    // makes the cost model pick resampling on every update
+    auto force_resample = [](StackIndex &I) {
+        I.restack_cost.num_samples = 16;
+        I.restack_cost.c[0] = I.restack_cost.c[1] = 0;
+        I.restack_cost.c[2] = -1;
+    };
+
+    for (bool directed : {true, false}) {
+        for (auto &[scenario, updates] : scenarios) {
+            check<StackIndex>("stackindex", scenario, directed, updates);
+            check<StackIndex>("stackindex lazy", scenario, directed, updates, [](Config &C) { C.lazy_repair = true; });
+            check<StackIndex>("stackindex threads", scenario, directed, updates, [](Config &C) { C.num_threads = 3; });
+            check<StackIndex>("stackindex resample", scenario, directed, updates, [](Config &) {}, force_resample);
+            check<StackIndex_Keyed>("stackindex_keyed", scenario, directed, updates);
+            check<StackIndex_Keyed>("stackindex_keyed rekey", scenario, directed, updates,
+                                    [](Config &C) { C.stack_memory_target = 1; });
+        }
+    }
+    return failures != 0;
+}